@@ -0,0 +1,850 @@
+#include "Benchmarks.h"
+
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+void run_benchmarks()
+{
+	bench_read_scaling();
+	bench_mapped_read();
+	bench_create_disk();
+	bench_queue_depth();
+	bench_create_files();
+	bench_lazy_mount();
+	bench_append_log();
+	bench_path_lookup();
+	bench_open_close();
+	bench_create_threads();
+	bench_parallel_append();
+	bench_raw_read();
+	bench_read_ahead();
+	bench_async_read();
+	bench_batch_ingest();
+}
+
+/// <summary>
+/// Fills a VDisk with several equal files and reads all of them back using 1..N threads.
+/// Every thread reads its own share of the files, so the total amount of data is the same in each round.
+/// </summary>
+void bench_read_scaling()
+{
+	const std::string diskname = "bench_read.tfs";
+	const short files_count = 8;					// <-- Set how many files to spread the reads over
+	const size_t file_size = 4 * 1024 * 1024;		// <-- Set the size of each file, bytes
+	const short passes = 4;							// <-- Set how many times each file is read per round
+	const std::vector<short> threads_set = { 1, 2, 4, 8 };
+
+	std::filesystem::remove(diskname);
+	VFS vfs;
+	if (!vfs.CreateAndMount(diskname, uint64_t(files_count) * file_size * 2)) return;
+
+	std::vector<std::string> paths;
+	std::string payload = make_payload(file_size);
+	for (short i = 0; i != files_count; ++i)
+	{
+		paths.push_back("bench\\read_" + std::to_string(i));
+		File* f = vfs.Create(paths.back().c_str());
+		if (!f) return;
+		vfs.Write(f, payload.data(), payload.size());
+		vfs.Close(f);
+	}
+
+	std::vector<std::pair<short, double>> results;
+	for (short threads : threads_set)
+	{
+		auto worker = [&](short id)
+		{
+			std::vector<char> buff(file_size);
+			for (short pass = 0; pass != passes; ++pass)
+				for (short i = id; i < files_count; i += threads)
+				{
+					File* f = vfs.Open(paths[i].c_str());
+					if (!f) continue;
+					vfs.Read(f, buff.data(), buff.size());
+					vfs.Close(f);
+				}
+		};
+
+		auto start = std::chrono::steady_clock::now();
+		std::vector<std::thread> pool;
+		for (short t = 0; t != threads; ++t) pool.emplace_back(worker, t);
+		for (auto& t : pool) t.join();
+		results.emplace_back(threads, seconds_since(start));
+	}
+
+	vfs.Unmount(diskname);
+	std::filesystem::remove(diskname);
+
+	const double total_mb = double(files_count) * passes * file_size / (1024 * 1024);
+	std::cout << "\n>> Read scaling, " << total_mb << " MB per round:\n";
+	for (const auto& [threads, seconds] : results)
+		std::cout << "   " << threads << " thread(s): " << seconds << " s, " << total_mb / seconds << " MB/s\n";
+}
+
+/// <summary>
+/// Reads one file repeatedly through the positional path (Read into a buffer) and through the mapping (ReadView).
+/// Both consume the data by touching one byte per cache line, so the difference is the copy itself.
+/// </summary>
+void bench_mapped_read()
+{
+	const std::string diskname = "bench_mmap.tfs";
+	const std::vector<size_t> sizes = { 1024, 64 * 1024, 16 * 1024 * 1024 };
+	const size_t volume = 512 * 1024 * 1024;		// <-- Set how many bytes to read per measurement
+
+	std::vector<std::tuple<size_t, double, double>> results;
+	for (size_t size : sizes)
+	{
+		double took[2] = { 0, 0 };
+		for (bool mapped : { false, true })
+		{
+			MountOptions options;
+			options.mapped = mapped;
+			std::filesystem::remove(diskname);
+			VFS vfs;
+			if (!vfs.CreateAndMount(diskname, size * 2 + 64 * 1024, options)) return;
+
+			std::string payload = make_payload(size);
+			File* f = vfs.Create("bench\\mmap");
+			if (!f) return;
+			vfs.Write(f, payload.data(), payload.size());
+			vfs.Close(f);
+
+			f = vfs.Open("bench\\mmap");
+			std::vector<char> buff(size);
+			volatile char sink = 0;
+			const size_t rounds = std::max(volume / size, size_t(1));
+			auto start = std::chrono::steady_clock::now();
+			for (size_t r = 0; r != rounds; ++r)
+			{
+				if (mapped)
+				{
+					for (auto view : vfs.ReadView(f))
+						for (size_t i = 0; i < view.size(); i += 64) sink = sink + view[i];
+				}
+				else
+				{
+					size_t read = vfs.Read(f, buff.data(), buff.size());
+					for (size_t i = 0; i < read; i += 64) sink = sink + buff[i];
+				}
+			}
+			took[mapped] = seconds_since(start);
+			vfs.Close(f);
+			vfs.Unmount(diskname);
+		}
+		results.emplace_back(size, took[0], took[1]);
+	}
+	std::filesystem::remove(diskname);
+
+	const double total_mb = double(volume) / (1024 * 1024);
+	std::cout << "\n>> Mapped reads, " << total_mb << " MB per measurement:\n";
+	for (const auto& [size, copied, viewed] : results)
+		std::cout << "   " << size << " B files: Read " << total_mb / copied << " MB/s, ReadView " << total_mb / viewed << " MB/s\n";
+}
+
+/// <summary>
+/// Measures CreateAndMount for growing disk sizes, up to the 4 GB limit of IsValidSize.
+/// </summary>
+void bench_create_disk()
+{
+	const std::string diskname = "bench_create.tfs";
+	const std::vector<uint64_t> sizes = { 16ull << 20, 256ull << 20, 1ull << 30, UINT32_MAX };
+
+	std::vector<std::tuple<uint64_t, double, double>> results;
+	for (uint64_t size : sizes)
+	{
+		double took[2] = { 0, 0 };
+		for (Provisioning provisioning : { Provisioning::Sparse, Provisioning::Preallocated })
+		{
+			MountOptions options;
+			options.provisioning = provisioning;
+			std::filesystem::remove(diskname);
+			VFS vfs;
+			auto start = std::chrono::steady_clock::now();
+			if (!vfs.CreateAndMount(diskname, size, options)) return;
+			took[provisioning == Provisioning::Preallocated] = seconds_since(start);
+			vfs.Unmount(diskname);
+		}
+		results.emplace_back(size, took[0], took[1]);
+	}
+	std::filesystem::remove(diskname);
+
+	std::cout << "\n>> Disk creation:\n";
+	for (const auto& [size, sparse, preallocated] : results)
+		std::cout << "   " << (size >> 20) << " MB: sparse " << sparse << " s, preallocated " << preallocated << " s\n";
+}
+
+/// <summary>
+/// Writes and reads back one large file with the io_uring engine at different queue depths.
+/// Every call of WriteInFile/ReadFromFile is a single batch of block requests.
+/// </summary>
+void bench_queue_depth()
+{
+	const std::string diskname = "bench_qd.tfs";
+	const size_t file_size = 32 * 1024 * 1024;		// <-- Set the file size, bytes
+	const short passes = 8;							// <-- Set how many times the file is read
+	const std::vector<unsigned> depths = { 0, 1, 4, 16, 64, 256 };
+
+	std::string payload = make_payload(file_size);
+	std::vector<std::tuple<unsigned, double, double>> results;
+	for (unsigned depth : depths)
+	{
+		MountOptions options;
+		options.queueDepth = depth;
+		std::filesystem::remove(diskname);
+		VFS vfs;
+		if (!vfs.CreateAndMount(diskname, file_size * 2, options)) return;
+
+		auto start = std::chrono::steady_clock::now();
+		File* f = vfs.Create("bench\\qd");
+		if (!f) return;
+		vfs.Write(f, payload.data(), payload.size());
+		vfs.Close(f);
+		double wrote = seconds_since(start);
+
+		std::vector<char> buff(file_size);
+		f = vfs.Open("bench\\qd");
+		start = std::chrono::steady_clock::now();
+		for (short pass = 0; pass != passes; ++pass) vfs.Read(f, buff.data(), buff.size());
+		double read = seconds_since(start);
+		vfs.Close(f);
+		vfs.Unmount(diskname);
+		results.emplace_back(depth, wrote, read);
+	}
+	std::filesystem::remove(diskname);
+
+	const double mb = double(file_size) / (1024 * 1024);
+	std::cout << "\n>> Queue depth, " << mb << " MB file:\n";
+	for (const auto& [depth, wrote, read] : results)
+		std::cout << "   depth " << depth << ": write " << mb / wrote << " MB/s, read " << mb * passes / read << " MB/s\n";
+}
+
+/// <summary>
+/// Creates many empty files spread over directories and reports the time of every step of 10k creations,
+/// then the time of unmounting.
+/// </summary>
+void bench_create_files()
+{
+	const std::string diskname = "bench_files.tfs";
+	const uint32_t files_count = 100000;		// <-- Set how many files to create
+	const uint32_t per_dir = 1000;				// <-- Set how many files go into one directory
+	const uint32_t step = 10000;
+
+	std::filesystem::remove(diskname);
+	VFS vfs;
+	if (!vfs.CreateAndMount(diskname, uint64_t(files_count + files_count / per_dir + 1) * (NODEDATA + CLUSTER * BLOCK) + DISKDATA + JOURNAL)) return;
+
+	std::vector<double> steps;
+	auto start = std::chrono::steady_clock::now();
+	for (uint32_t i = 0; i != files_count; ++i)
+	{
+		std::string path = "bench\\d" + std::to_string(i / per_dir) + "\\f" + std::to_string(i);
+		vfs.Close(vfs.Create(path.c_str()));
+		if ((i + 1) % step == 0)
+		{
+			steps.push_back(seconds_since(start));
+			start = std::chrono::steady_clock::now();
+		}
+	}
+	start = std::chrono::steady_clock::now();
+	vfs.Unmount(diskname);
+	double unmount = seconds_since(start);
+	std::filesystem::remove(diskname);
+
+	std::cout << "\n>> Creating " << files_count << " files:\n";
+	for (size_t i = 0; i != steps.size(); ++i)
+		std::cout << "   files " << i * step << "-" << (i + 1) * step << ": " << steps[i] << " s\n";
+	std::cout << "   unmount: " << unmount << " s\n";
+}
+
+/// <summary>
+/// Fills a VDisk with many small files, then mounts it eagerly, lazily and lazily with the prefetcher.
+/// For each mode reports the mount time, the growth of resident memory and the time of opening every file once,
+/// which is where the lazy mode pays for the skipped loading.
+/// </summary>
+void bench_lazy_mount()
+{
+	std::string diskname = "bench_mount.tfs";
+	const uint32_t files_count = 50000;		// <-- Set how many files to create
+	const uint32_t per_dir = 500;			// <-- Set how many files go into one directory
+
+	std::filesystem::remove(diskname);
+	std::vector<std::string> paths;
+	{
+		VFS vfs;
+		if (!vfs.CreateAndMount(diskname, uint64_t(files_count + files_count / per_dir + 1) * (NODEDATA + CLUSTER * BLOCK) + DISKDATA + JOURNAL)) return;
+		for (uint32_t i = 0; i != files_count; ++i)
+		{
+			paths.push_back("bench\\d" + std::to_string(i / per_dir) + "\\f" + std::to_string(i));
+			vfs.Close(vfs.Create(paths.back().c_str()));
+		}
+	}
+
+	struct Mode
+	{
+		std::string title;
+		MountOptions options;
+	};
+	std::vector<Mode> modes = { { "lazy", {} }, { "lazy + prefetch", {} }, { "eager", {} } };	// Eager goes last: freed memory is reused
+	modes[0].options.lazy = modes[1].options.lazy = modes[1].options.prefetch = true;
+
+	std::vector<std::string> results;
+	for (auto& mode : modes)
+	{
+		VFS vfs;
+		size_t rss = resident_bytes();
+		auto start = std::chrono::steady_clock::now();
+		if (!vfs.MountOrCreate(diskname, mode.options)) return;
+		double mount = seconds_since(start);
+		size_t grown = resident_bytes() - rss;
+
+		start = std::chrono::steady_clock::now();
+		for (const auto& path : paths) vfs.Close(vfs.Open(path.c_str()));
+		double lookups = seconds_since(start);
+
+		std::ostringstream line;
+		line << "   " << mode.title << ": mount " << mount << " s, +" << grown / 1024 << " KB resident, opening all files " << lookups << " s\n";
+		results.push_back(line.str());
+	}
+	std::filesystem::remove(diskname);
+
+	std::cout << "\n>> Mounting a disk with " << files_count << " files:\n";
+	for (const auto& line : results) std::cout << line;
+}
+
+/// <summary>
+/// Appends to one file in small writes, like a log, and reports the mean and the worst latency of a write
+/// for every step of the file size. Flat numbers mean that an append doesn't depend on the file size.
+/// </summary>
+void bench_append_log()
+{
+	const std::string diskname = "bench_append.tfs";
+	const uint64_t total = 1ull << 30;		// <-- Set how many bytes to append
+	const size_t write_size = 4096;			// <-- Set the size of one write
+	const uint64_t step = 64ull << 20;		// <-- Set the file size step to report
+
+	std::filesystem::remove(diskname);
+	VFS vfs;
+	if (!vfs.CreateAndMount(diskname, total + total / 8 + DISKDATA + JOURNAL)) return;
+	File* f = vfs.Create("log");
+	if (!f) return;
+
+	std::string payload = make_payload(write_size);
+	std::vector<std::pair<double, double>> steps;	// Mean and worst write, s
+	double sum = 0, worst = 0;
+	uint64_t written = 0, count = 0;
+	while (written != total)
+	{
+		auto start = std::chrono::steady_clock::now();
+		size_t wrote = vfs.Write(f, payload.data(), write_size);
+		double took = seconds_since(start);
+		if (wrote != write_size) break;
+		sum += took;
+		worst = std::max(worst, took);
+		++count;
+		written += wrote;
+		if (written % step == 0)
+		{
+			steps.emplace_back(sum / count, worst);
+			sum = worst = 0;
+			count = 0;
+		}
+	}
+	vfs.Close(f);
+	vfs.Unmount(diskname);
+	std::filesystem::remove(diskname);
+
+	std::cout << "\n>> Appending " << written / (1 << 20) << " MB in " << write_size << " B writes:\n";
+	for (size_t i = 0; i != steps.size(); ++i)
+		std::cout << "   " << i * step / (1 << 20) << "-" << (i + 1) * step / (1 << 20) << " MB: mean "
+			<< steps[i].first * 1e6 << " us, worst " << steps[i].second * 1e6 << " us\n";
+}
+
+/// <summary>
+/// Resolves paths in the in-memory file tree, without touching any VDisk: a directory of 10, 1k and 100k files
+/// three levels deep. The paths are resolved in a shuffled order, so the lookups don't follow the insertion order.
+/// </summary>
+void bench_path_lookup()
+{
+	const std::vector<uint32_t> sizes = { 10, 1000, 100000 };	// <-- Set the directory sizes
+	const uint32_t lookups = 1000000;							// <-- Set how many paths to resolve per size
+
+	File file(0, "file", "bench");
+	std::vector<std::string> results;
+	for (uint32_t size : sizes)
+	{
+		Vertice<File*> root;
+		std::vector<std::string> paths;
+		for (uint32_t i = 0; i != size; ++i)
+		{
+			paths.push_back("bench\\dir\\sub\\file_" + std::to_string(i * 2654435761u));
+			root.Add(paths.back(), &file);
+		}
+		std::vector<uint32_t> order(lookups);
+		for (uint32_t i = 0; i != lookups; ++i) order[i] = uint32_t((uint64_t(i) * 40503u) % size);
+
+		size_t found = 0;
+		auto start = std::chrono::steady_clock::now();
+		for (uint32_t i : order) found += root.GetData(paths[i]) == &file;
+		double took = seconds_since(start);
+		root.Destroy();
+
+		std::ostringstream line;
+		line << "   " << size << " entries: " << took / lookups * 1e9 << " ns per path" << (found == lookups ? "" : " (lookups failed)") << "\n";
+		results.push_back(line.str());
+	}
+
+	std::cout << "\n>> Resolving " << lookups << " paths of 4 components:\n";
+	for (const auto& line : results) std::cout << line;
+}
+
+/// <summary>
+/// Opens and closes files from 1..N threads: each thread on its own files, then all threads reading the same file.
+/// The VFS log is muted while timing, as the writes to stdout would serialize the threads on their own.
+/// </summary>
+void bench_open_close()
+{
+	const std::string diskname = "bench_open.tfs";
+	const uint32_t files_count = 64;				// <-- Set how many files the threads share out
+	const uint32_t rounds = 200000;					// <-- Set how many open/close pairs each thread makes
+	const std::vector<short> threads_set = { 1, 2, 4, 8 };
+
+	std::filesystem::remove(diskname);
+	VFS vfs;
+	if (!vfs.CreateAndMount(diskname, uint64_t(files_count + 2) * (NODEDATA + CLUSTER * BLOCK) + DISKDATA + JOURNAL)) return;
+	std::vector<std::string> paths;
+	for (uint32_t i = 0; i != files_count; ++i)
+	{
+		paths.push_back("bench\\open_" + std::to_string(i));
+		vfs.Close(vfs.Create(paths.back().c_str()));
+	}
+
+	std::vector<std::string> results;
+	for (bool shared : { false, true })
+		for (short threads : threads_set)
+		{
+			std::atomic<uint32_t> failed = 0;
+			auto worker = [&](short id)
+			{
+				for (uint32_t i = 0; i != rounds; ++i)
+				{
+					File* f = vfs.Open(paths[shared ? 0 : (id + i * threads) % files_count].c_str());
+					if (!f) ++failed;
+					vfs.Close(f);
+				}
+			};
+
+			std::streambuf* log = std::cout.rdbuf(nullptr);
+			auto start = std::chrono::steady_clock::now();
+			std::vector<std::thread> pool;
+			for (short t = 0; t != threads; ++t) pool.emplace_back(worker, t);
+			for (auto& t : pool) t.join();
+			double took = seconds_since(start);
+			std::cout.rdbuf(log);
+
+			std::ostringstream line;
+			line << "   " << (shared ? "same file, " : "own files, ") << threads << " threads: "
+				<< uint64_t(threads) * rounds / took / 1e6 << " M pairs/s" << (failed ? " (" + std::to_string(failed) + " opens failed)" : "") << "\n";
+			results.push_back(line.str());
+		}
+
+	vfs.Unmount(diskname);
+	std::filesystem::remove(diskname);
+
+	std::cout << "\n>> Open/close pairs, " << rounds << " per thread:\n";
+	for (const auto& line : results) std::cout << line;
+}
+
+/// <summary>
+/// Creates the same number of files with 1..N threads, every thread in its own directory,
+/// and reports the creations per second. Every creation waits for its journal commit.
+/// </summary>
+void bench_create_threads()
+{
+	const std::string diskname = "bench_create_mt.tfs";
+	const uint32_t files_count = 2000;				// <-- Set how many files to create per round
+	const std::vector<short> threads_set = { 1, 2, 4, 8 };
+
+	std::filesystem::remove(diskname);
+	VFS vfs;
+	const uint64_t nodes = uint64_t(files_count + 8) * threads_set.size();
+	if (!vfs.CreateAndMount(diskname, nodes * (NODEDATA + CLUSTER * BLOCK) + DISKDATA + JOURNAL)) return;
+
+	std::vector<std::string> results;
+	for (short threads : threads_set)
+	{
+		std::atomic<uint32_t> failed = 0;
+		auto worker = [&](short id)
+		{
+			const std::string dir = "bench\\t" + std::to_string(threads) + "_" + std::to_string(id) + "\\f";
+			for (uint32_t i = id; i < files_count; i += threads)
+			{
+				File* f = vfs.Create((dir + std::to_string(i)).c_str());
+				if (!f) ++failed;
+				vfs.Close(f);
+			}
+		};
+
+		std::streambuf* log = std::cout.rdbuf(nullptr);
+		auto start = std::chrono::steady_clock::now();
+		std::vector<std::thread> pool;
+		for (short t = 0; t != threads; ++t) pool.emplace_back(worker, t);
+		for (auto& t : pool) t.join();
+		double took = seconds_since(start);
+		std::cout.rdbuf(log);
+
+		std::ostringstream line;
+		line << "   " << threads << " threads: " << files_count / took << " files/s" << (failed ? " (" + std::to_string(failed) + " failed)" : "") << "\n";
+		results.push_back(line.str());
+	}
+
+	vfs.Unmount(diskname);
+	std::filesystem::remove(diskname);
+
+	std::cout << "\n>> Creating " << files_count << " files, a directory per thread:\n";
+	for (const auto& line : results) std::cout << line;
+}
+
+/// <summary>
+/// Appends to one file per thread from 1..N threads at once and reports the total throughput
+/// and how many extents the files ended up in: interleaved allocations split every file into many short runs.
+/// </summary>
+void bench_parallel_append()
+{
+	const std::string diskname = "bench_append_mt.tfs";
+	const size_t file_size = 8 * 1024 * 1024;		// <-- Set the size each file grows to, bytes
+	const size_t write_size = 4 * 1024;				// <-- Set the size of a single append, bytes
+	const std::vector<short> threads_set = { 1, 2, 4, 8 };
+
+	std::filesystem::remove(diskname);
+	VFS vfs;
+	short files_count = 0;
+	for (short threads : threads_set) files_count += threads;
+	if (!vfs.CreateAndMount(diskname, files_count * (file_size + file_size / 8) + DISKDATA + JOURNAL)) return;
+	const std::string payload = make_payload(write_size);
+
+	std::vector<std::string> results;
+	for (short threads : threads_set)
+	{
+		std::vector<File*> files;
+		for (short t = 0; t != threads; ++t)
+			files.push_back(vfs.Create(("bench\\append_" + std::to_string(threads) + "_" + std::to_string(t)).c_str()));
+		if (std::find(files.begin(), files.end(), nullptr) != files.end()) return;
+		auto worker = [&](File* f)
+		{
+			for (size_t written = 0; written < file_size; written += write_size)
+				vfs.Write(f, const_cast<char*>(payload.data()), write_size);
+		};
+
+		std::streambuf* log = std::cout.rdbuf(nullptr);
+		auto start = std::chrono::steady_clock::now();
+		std::vector<std::thread> pool;
+		for (File* f : files) pool.emplace_back(worker, f);
+		for (auto& t : pool) t.join();
+		double took = seconds_since(start);
+		std::cout.rdbuf(log);
+
+		uint32_t extents = 0;
+		for (File* f : files)
+		{
+			extents += f->CountExtents();
+			vfs.Close(f);
+		}
+		std::ostringstream line;
+		line << "   " << threads << " threads: " << threads * file_size / took / (1 << 20) << " MB/s, "
+			<< double(extents) / threads << " extents per file\n";
+		results.push_back(line.str());
+	}
+
+	vfs.Unmount(diskname);
+	std::filesystem::remove(diskname);
+
+	std::cout << "\n>> Appending " << file_size / (1 << 20) << " MB per thread in " << write_size << " B writes:\n";
+	for (const auto& line : results) std::cout << line;
+}
+
+/// <summary>
+/// Reads whole files of growing sizes through the VFS and compares the throughput with reading the same bytes
+/// from a plain file in one call. The striped file is spread over two VDisks: each member's stripes land in the
+/// buffer apart from each other, so they are read with vectored calls.
+/// </summary>
+void bench_raw_read()
+{
+	const std::vector<std::string> disknames = { "bench_raw_0.tfs", "bench_raw_1.tfs" };
+	const std::string rawname = "bench_raw.bin";
+	const std::vector<size_t> sizes = { 16 * 1024, 1024 * 1024, 16 * 1024 * 1024, 128 * 1024 * 1024 };
+	const size_t volume = 1024 * 1024 * 1024;		// <-- Set how many bytes to read per measurement
+
+	std::vector<std::string> results;
+	for (size_t size : sizes)
+	{
+		const std::string payload = make_payload(size);
+		const size_t rounds = std::max(volume / size, size_t(1));
+		std::vector<char> buff(size);
+		double took[3] = { 0, 0, 0 };
+
+		std::ofstream(rawname, std::ios::binary).write(payload.data(), payload.size());
+		{
+			std::ifstream raw(rawname, std::ios::binary);
+			auto start = std::chrono::steady_clock::now();
+			for (size_t r = 0; r != rounds; ++r)
+			{
+				raw.seekg(0);
+				raw.read(buff.data(), size);
+			}
+			took[0] = seconds_since(start);
+		}
+
+		for (const auto& name : disknames) std::filesystem::remove(name);
+		VFS vfs;
+		for (const auto& name : disknames)
+			if (!vfs.CreateAndMount(name, size * 2 + (1 << 20))) return;
+		CreateOptions striped;
+		striped.stripes = 2;
+		const char* paths[] = { "bench\\raw", "bench\\striped" };
+		for (int i : { 1, 2 })
+		{
+			File* f = vfs.Create(paths[i - 1], i == 2 ? striped : CreateOptions{});
+			if (!f) return;
+			vfs.Write(f, const_cast<char*>(payload.data()), payload.size());
+			vfs.Close(f);
+
+			f = vfs.Open(paths[i - 1]);
+			std::streambuf* log = std::cout.rdbuf(nullptr);
+			auto start = std::chrono::steady_clock::now();
+			for (size_t r = 0; r != rounds; ++r) vfs.Read(f, buff.data(), size);
+			took[i] = seconds_since(start);
+			std::cout.rdbuf(log);
+			vfs.Close(f);
+		}
+		for (const auto& name : disknames) vfs.Unmount(name);
+
+		const double total_mb = double(rounds) * size / (1 << 20);
+		std::ostringstream line;
+		line << "   " << size << " B files: raw " << total_mb / took[0] << " MB/s, Read " << total_mb / took[1]
+			<< " MB/s (" << int(took[0] / took[1] * 100) << "%), striped Read " << total_mb / took[2] << " MB/s\n";
+		results.push_back(line.str());
+	}
+	for (const auto& name : disknames) std::filesystem::remove(name);
+	std::filesystem::remove(rawname);
+
+	std::cout << "\n>> Whole-file reads against a plain file, " << volume / (1 << 20) << " MB per measurement:\n";
+	for (const auto& line : results) std::cout << line;
+}
+
+/// <summary>
+/// Streams a file through ReadAt in small chunks, checksumming every chunk, without and with read-ahead,
+/// then reads chunks at random offsets. The read-ahead counters are reported as the difference per round.
+/// </summary>
+void bench_read_ahead()
+{
+	const std::string diskname = "bench_ahead.tfs";
+	const size_t file_size = 256 * 1024 * 1024;	// <-- Set the size of the file, bytes
+	const size_t chunk = 16 * 1024;				// <-- Set the size of one ReadAt, bytes
+	const std::vector<std::tuple<std::string, size_t, bool>> rounds = {	// Name, read-ahead window, random offsets
+		{ "sequential, no read-ahead", 0, false },
+		{ "sequential, read-ahead", ReadAhead::DEFAULT_WINDOW, false },
+		{ "random, read-ahead", ReadAhead::DEFAULT_WINDOW, true } };
+
+	std::filesystem::remove(diskname);
+	VFS vfs;
+	if (!vfs.CreateAndMount(diskname, file_size + (16 << 20))) return;
+	File* f = vfs.Create("bench\\stream");
+	if (!f) return;
+	std::string payload = make_payload(64 * 1024 * 1024);
+	for (size_t wrote = 0; wrote < file_size; wrote += payload.size()) vfs.Write(f, payload.data(), payload.size());
+	vfs.Close(f);
+	payload.clear();
+
+	std::vector<std::string> results;
+	std::vector<char> buff(chunk);
+	uint64_t offset = 0, sum = 0, state = 1;
+	for (const auto& [name, window, random] : rounds)
+	{
+		vfs.SetReadAhead(window);
+		const ReadAhead::Stats before = vfs.GetReadAheadStats();
+		f = vfs.Open("bench\\stream");
+		std::streambuf* log = std::cout.rdbuf(nullptr);
+		auto start = std::chrono::steady_clock::now();
+		for (size_t read = 0; read < file_size; read += chunk)
+		{
+			if (random)
+			{
+				state = state * 6364136223846793005ull + 1442695040888963407ull;
+				offset = (state >> 16) % (file_size / chunk) * chunk;
+			}
+			else offset = read;
+			vfs.ReadAt(f, offset, buff.data(), chunk);
+			for (char c : buff) sum += uint8_t(c);		// Work on the data while the next window is read
+		}
+		double took = seconds_since(start);
+		std::cout.rdbuf(log);
+		vfs.Close(f);
+
+		const ReadAhead::Stats after = vfs.GetReadAheadStats();
+		const uint64_t hits = after.hits - before.hits, total = hits + after.misses - before.misses;
+		std::ostringstream line;
+		line << "   " << name << ": " << file_size / took / (1 << 20) << " MB/s, "
+			<< (total ? hits * 100.0 / total : 0.0) << "% hits, " << after.windows - before.windows << " windows\n";
+		results.push_back(line.str());
+	}
+
+	vfs.Unmount(diskname);
+	std::filesystem::remove(diskname);
+
+	std::cout << "\n>> ReadAt in " << chunk / 1024 << " KB chunks over a " << file_size / (1 << 20) << " MB file (checksum " << sum % 1000 << "):\n";
+	for (const auto& line : results) std::cout << line;
+}
+
+/// <summary>
+/// One thread reads many small files: Open, Read and Close one after another, then the same calls through the
+/// async API with all files in flight at once, for several IOPool sizes.
+/// </summary>
+void bench_async_read()
+{
+	const std::string diskname = "bench_async.tfs";
+	const size_t files_count = 4096;				// <-- Set how many files to read per round
+	const size_t file_size = 64 * 1024;				// <-- Set the size of each file, bytes
+	const std::vector<unsigned> threads_set = { 0, 4, 16, 64 };	// IOPool workers; 0 == blocking calls
+
+	std::filesystem::remove(diskname);
+	VFS vfs;
+	if (!vfs.CreateAndMount(diskname, files_count * (file_size + 4 * 1024) + (16 << 20))) return;
+	std::vector<std::string> paths;
+	std::string payload = make_payload(file_size);
+	std::streambuf* log = std::cout.rdbuf(nullptr);
+	for (size_t i = 0; i != files_count; ++i)
+	{
+		paths.push_back("bench\\async_" + std::to_string(i));
+		File* f = vfs.Create(paths.back().c_str());
+		if (f) vfs.Write(f, payload.data(), payload.size());
+		vfs.Close(f);
+	}
+
+	std::vector<std::vector<char>> buffs(files_count, std::vector<char>(file_size));
+	std::vector<std::pair<unsigned, double>> results;
+	for (unsigned threads : threads_set)
+	{
+		auto start = std::chrono::steady_clock::now();
+		if (!threads)
+			for (size_t i = 0; i != files_count; ++i)
+			{
+				File* f = vfs.Open(paths[i].c_str());
+				vfs.Read(f, buffs[i].data(), file_size);
+				vfs.Close(f);
+			}
+		else
+		{
+			vfs.SetIOThreads(threads);
+			std::vector<std::future<File*>> opened;
+			for (const auto& path : paths) opened.push_back(vfs.OpenAsync(path.c_str()));
+			std::vector<std::future<size_t>> read;
+			for (size_t i = 0; i != files_count; ++i)
+			{
+				File* f = opened[i].get();
+				read.push_back(vfs.ReadAsync(f, buffs[i].data(), file_size));
+				vfs.CloseAsync(f);		// Runs after the read of the same file
+			}
+			for (auto& r : read) r.get();
+		}
+		results.emplace_back(threads, seconds_since(start));
+	}
+	vfs.SetIOThreads(IOPool::DEFAULT_THREADS);
+	std::cout.rdbuf(log);
+
+	vfs.Unmount(diskname);
+	std::filesystem::remove(diskname);
+
+	std::cout << "\n>> Reading " << files_count << " files of " << file_size / 1024 << " KB from one thread:\n";
+	for (const auto& [threads, seconds] : results)
+		std::cout << "   " << (threads ? "async, " + std::to_string(threads) + " workers" : std::string("blocking")) << ": "
+			<< files_count / seconds << " files/s\n";
+}
+
+/// <summary>
+/// Ingests many small files: Create, Write and Close per file, then CreateBatch and WriteBatch per batch of files
+/// followed by the Close calls. Reports the files per second each way.
+/// </summary>
+void bench_batch_ingest()
+{
+	const std::string diskname = "bench_ingest.tfs";
+	const uint32_t files_count = 100000;		// <-- Set how many files to ingest
+	const uint32_t per_dir = 1000;				// <-- Set how many files go into one directory
+	const size_t file_size = 512;				// <-- Set the size of each file, bytes
+	const size_t batch = 1000;					// <-- Set how many files go into one batch call
+
+	const std::string payload = make_payload(file_size);
+	std::vector<std::pair<std::string, double>> results;
+	for (bool batched : { false, true })
+	{
+		std::filesystem::remove(diskname);
+		VFS vfs;
+		if (!vfs.CreateAndMount(diskname, uint64_t(files_count + files_count / per_dir + 1) * (NODEDATA + CLUSTER * BLOCK) + DISKDATA + JOURNAL)) return;
+		std::vector<std::string> paths;
+		for (uint32_t i = 0; i != files_count; ++i)
+			paths.push_back("bench\\d" + std::to_string(i / per_dir) + "\\f" + std::to_string(i));
+
+		std::streambuf* log = std::cout.rdbuf(nullptr);
+		auto start = std::chrono::steady_clock::now();
+		if (!batched)
+			for (const auto& path : paths)
+			{
+				File* f = vfs.Create(path.c_str());
+				if (f) vfs.Write(f, const_cast<char*>(payload.data()), payload.size());
+				vfs.Close(f);
+			}
+		else
+			for (size_t first = 0; first < paths.size(); first += batch)
+			{
+				std::vector<std::string> names(paths.begin() + first, paths.begin() + std::min(first + batch, paths.size()));
+				std::vector<File*> files = vfs.CreateBatch(names);
+				std::vector<BatchItem> items;
+				for (File* f : files)
+					if (f) items.push_back({ f, const_cast<char*>(payload.data()), payload.size() });
+				vfs.WriteBatch(items);
+				for (File* f : files) vfs.Close(f);
+			}
+		double took = seconds_since(start);
+		std::cout.rdbuf(log);
+		results.emplace_back(batched ? "batches of " + std::to_string(batch) : std::string("one by one"), took);
+
+		vfs.Unmount(diskname);
+	}
+	std::filesystem::remove(diskname);
+
+	std::cout << "\n>> Ingesting " << files_count << " files of " << file_size << " B:\n";
+	for (const auto& [name, seconds] : results)
+		std::cout << "   " << name << ": " << seconds << " s, " << files_count / seconds << " files/s\n";
+}
+
+/* ---Helpers--------------------------------------------------------------- */
+
+double seconds_since(std::chrono::steady_clock::time_point start)
+{
+	std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+	return took.count();
+}
+std::string make_payload(size_t length)
+{
+	std::string payload(length, '\0');
+	for (size_t i = 0; i != length; ++i) payload[i] = char('a' + i % 26);
+	return payload;
+}
+size_t resident_bytes()
+{
+#ifdef __linux__
+	size_t pages = 0, resident = 0;
+	std::ifstream statm("/proc/self/statm");
+	statm >> pages >> resident;
+	return resident * size_t(sysconf(_SC_PAGESIZE));
+#else
+	return 0;
+#endif
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <chrono>
+#include "IVFS.h"
+
+/* ---Benchmarks------------------------------------------------------------ */
+
+// Each benchmark creates its own scratch VDisk next to the executable and removes it when done.
+// Results are printed to stdout; the VFS log lines are printed as usual.
+
+void run_benchmarks();
+
+void bench_read_scaling();		// Read throughput of one VDisk against the number of reader threads
+void bench_mapped_read();		// Read (copying) versus ReadView on a mapped VDisk for small, medium and large files
+void bench_create_disk();		// VDisk creation time against the disk size, sparse and preallocated
+void bench_queue_depth();		// Write and read throughput against the io_uring queue depth (0 = synchronous path)
+void bench_create_files();		// Time of creating 100k files, reported per 10k: flat numbers mean linear total time
+void bench_lazy_mount();		// Mount time, resident memory and first lookups of a disk with many files: eager, lazy, lazy + prefetch
+void bench_append_log();		// Latency of 4 KB appends to one file while it grows to 1 GB, reported per 64 MB
+void bench_path_lookup();		// Path resolution in the file tree for directories of 10, 1k and 100k entries
+void bench_open_close();		// Open/close pairs per second from 1..8 threads, on separate files and on one shared file
+void bench_create_threads();	// File creations per second from 1..8 threads, each in its own directory
+void bench_parallel_append();	// Throughput and fragmentation of 1..8 threads appending to their own files at once
+void bench_raw_read();			// Whole-file Read throughput against the file size, next to reading a plain file
+void bench_read_ahead();		// Streaming a file through small ReadAt calls without and with read-ahead, and random reads
+void bench_async_read();		// Reading many small files from one thread: blocking calls against the async API
+void bench_batch_ingest();		// Ingesting 100k small files one by one against the batch calls
+
+/* ---Helpers--------------------------------------------------------------- */
+
+double seconds_since(std::chrono::steady_clock::time_point start);
+std::string make_payload(size_t length);
+size_t resident_bytes();		// Resident set size of the process, 0 where it's not measured
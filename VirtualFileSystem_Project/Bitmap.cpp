@@ -0,0 +1,135 @@
+#include "Bitmap.h"
+
+#include <algorithm>
+#include <bitset>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/* ---Bitmap---------------------------------------------------------------- */
+
+Bitmap::Bitmap(uint32_t bits) :
+	bits(bits),
+	words((size_t(bits) + WORD - 1) / WORD, 0),
+	summary((size_t(bits) + GROUP - 1) / GROUP, GROUP),
+	free(bits)
+{
+	if (bits % WORD) words.back() = ~0ull << (bits % WORD);
+	if (bits % GROUP) summary.back() = bits % GROUP;
+}
+
+/// <summary>
+/// Replaces the whole bitmap with the stored one and recounts the summary.
+/// </summary>
+void Bitmap::Load(const char* bytes)
+{
+	free = 0;
+	std::fill(summary.begin(), summary.end(), 0);
+	for (size_t w = 0; w != words.size(); ++w)
+	{
+		uint64_t word = 0;
+		for (int i = 7; i >= 0; --i) word = word << 8 | uint8_t(bytes[w * 8 + i]);
+		if (w == words.size() - 1 && bits % WORD) word |= ~0ull << (bits % WORD);
+		words[w] = word;
+		uint32_t count = uint32_t(WORD - std::bitset<WORD>(word).count());
+		summary[w * WORD / GROUP] += count;
+		free += count;
+	}
+}
+void Bitmap::Store(uint64_t word, char* bytes)
+{
+	for (int i = 0; i != 8; ++i) bytes[i] = char(word >> (i * 8) & 0xFF);
+}
+std::vector<uint32_t> Bitmap::TakeDirty()
+{
+	std::sort(dirty.begin(), dirty.end());
+	dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+	std::vector<uint32_t> taken;
+	taken.swap(dirty);
+	return taken;
+}
+
+void Bitmap::Change(uint32_t first, uint32_t count, bool used)
+{
+	for (uint32_t bit = first, end = first + count; bit != end; )
+	{
+		uint32_t w = bit / WORD, from = bit % WORD, n = std::min(WORD - from, end - bit);
+		uint64_t mask = (n == WORD ? ~0ull : ((1ull << n) - 1)) << from;
+		uint64_t changed = used ? mask & ~words[w] : mask & words[w];
+		uint32_t flipped = uint32_t(std::bitset<WORD>(changed).count());
+		words[w] ^= changed;
+		if (used)
+		{
+			summary[w * WORD / GROUP] -= flipped;
+			free -= flipped;
+		}
+		else
+		{
+			summary[w * WORD / GROUP] += flipped;
+			free += flipped;
+		}
+		if (changed) dirty.push_back(w);
+		bit += n;
+	}
+}
+
+uint32_t Bitmap::FindFree(uint32_t from, uint32_t to) const
+{
+	const uint32_t groupWords = GROUP / WORD;
+	uint32_t w = from / WORD;
+	uint64_t candidates = ~words[w] & (~0ull << (from % WORD));
+	while (true)
+	{
+		if (candidates)
+		{
+			uint32_t bit = w * WORD + CountTrailingZeros(candidates);
+			return bit < to ? bit : NONE;
+		}
+		if (++w * WORD >= to) return NONE;
+		if (w % groupWords == 0)	// Skip the full groups using the summary
+			while (!summary[w / groupWords])
+			{
+				w += groupWords;
+				if (w * WORD >= to) return NONE;
+			}
+		candidates = ~words[w];
+	}
+}
+/// <summary>
+/// Finds the first free bit at or after [hint] (then from the start) and measures the free run starting there.
+/// </summary>
+/// <returns>Start and length of the run, the length is at most [count]; {NONE, 0} if the bitmap is full</returns>
+std::pair<uint32_t, uint32_t> Bitmap::FindRun(uint32_t hint, uint32_t count) const
+{
+	if (!free || !count) return { NONE, 0 };
+	if (hint >= bits) hint = 0;
+	uint32_t start = FindFree(hint, bits);
+	if (start == NONE) start = FindFree(0, hint);
+	if (start == NONE) return { NONE, 0 };
+
+	uint32_t length = 0;
+	for (uint32_t bit = start; length != count; )
+	{
+		uint32_t offset = bit % WORD;
+		uint64_t used = words[bit / WORD] >> offset;
+		uint32_t run = used ? CountTrailingZeros(used) : WORD - offset;
+		uint32_t take = std::min(run, count - length);
+		length += take;
+		bit += take;
+		if (take != WORD - offset) break;	// Hit a used bit or got enough
+		if (bit >= bits) break;
+	}
+	return { start, length };
+}
+
+unsigned CountTrailingZeros(uint64_t word)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward64(&index, word);
+	return unsigned(index);
+#else
+	return unsigned(__builtin_ctzll(word));
+#endif
+}
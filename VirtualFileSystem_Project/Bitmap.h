@@ -0,0 +1,50 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/* ---Bitmap---------------------------------------------------------------- */
+
+/// <summary>
+/// In-memory free-block bitmap of a VDisk: bit i is set when block i is used.
+/// Bits are scanned a 64-bit word at a time; a summary keeps the number of free bits per group of GROUP bits,
+/// so that full regions of a large disk are skipped without touching their words.
+/// Words changed since the last TakeDirty are tracked for persisting.
+/// </summary>
+class Bitmap
+{
+public:
+	inline static const uint32_t WORD = 64;
+	inline static const uint32_t GROUP = 8192;		// Bits per summary entry: one bitmap block of 1 KB
+	inline static const uint32_t NONE = UINT32_MAX;
+
+private:
+	uint32_t bits;
+	std::vector<uint64_t> words;			// Bits past the end are kept set
+	std::vector<uint32_t> summary;			// Free bits per group
+	uint32_t free;
+	std::vector<uint32_t> dirty;			// Indices of changed words, may repeat
+
+	uint32_t FindFree(uint32_t from, uint32_t to) const;	// First free bit in [from, to), NONE if there is none
+	void Change(uint32_t first, uint32_t count, bool used);
+
+public:
+	uint32_t Size() const { return bits; };
+	uint32_t CountFree() const { return free; };
+	bool IsUsed(uint32_t bit) const { return words[bit / WORD] >> (bit % WORD) & 1; };
+	std::size_t CountWords() const { return words.size(); };
+	uint64_t GetWord(std::size_t index) const { return words[index]; };
+
+	void Use(uint32_t first, uint32_t count = 1) { Change(first, count, true); };
+	void Release(uint32_t first, uint32_t count = 1) { Change(first, count, false); };
+	std::pair<uint32_t, uint32_t> FindRun(uint32_t hint, uint32_t count) const;	// First free run at or after [hint], wrapping around
+
+	void Load(const char* bytes);			// Reads CountWords() words, 8 little-endian bytes each
+	static void Store(uint64_t word, char* bytes);
+	std::vector<uint32_t> TakeDirty();		// Sorted unique indices of the words changed since the last call
+
+	explicit Bitmap(uint32_t bits = 0);
+};
+
+unsigned CountTrailingZeros(uint64_t word);	// Index of the lowest set bit; the word must not be 0
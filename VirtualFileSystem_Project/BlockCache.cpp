@@ -0,0 +1,189 @@
+#include "BlockCache.h"
+#include "IVFS.h"
+
+#include <cstring>
+
+/* ---BlockCache------------------------------------------------------------ */
+
+BlockCache& BlockCache::Shared()
+{
+	static BlockCache cache(DEFAULT_BUDGET, BLOCK);
+	return cache;
+}
+
+BlockCache::BlockCache(size_t budget, size_t pageSize) :
+	pageSize(pageSize)
+{
+	SetBudget(budget);
+}
+BlockCache::~BlockCache()
+{
+	// Every VDisk drops its pages on unmount, so there is nothing left to write back here
+}
+
+BlockCache::Shard& BlockCache::ShardOf(BinDisk& disk, size_t start)
+{
+	return shards[KeyHash()({ &disk, start / (pageSize * RUN) }) % SHARDS];
+}
+
+/// <summary>
+/// Copies [count] bytes at [offset] within the page [start, start + length) of [disk].
+/// </summary>
+bool BlockCache::Read(BinDisk& disk, size_t start, size_t length, size_t offset, char* data, size_t count)
+{
+	Shard& shard = ShardOf(disk, start);
+	std::lock_guard<std::mutex> guard(shard.lock);
+	size_t frame = Fetch(shard, disk, start, length);
+	if (frame == shard.frames.size()) return disk.GetBytes(start + offset, data, count);
+	std::memcpy(data, PageData(shard, frame) + offset, count);
+	return true;
+}
+/// <summary>
+/// Updates [count] bytes at [offset] within the page. The page is written to [disk] later.
+/// </summary>
+bool BlockCache::Write(BinDisk& disk, size_t start, size_t length, size_t offset, const char* data, size_t count)
+{
+	Shard& shard = ShardOf(disk, start);
+	std::lock_guard<std::mutex> guard(shard.lock);
+	size_t frame = Fetch(shard, disk, start, length);
+	if (frame == shard.frames.size()) return disk.SetBytes(start + offset, data, count);
+	std::memcpy(PageData(shard, frame) + offset, data, count);
+	shard.frames[frame].dirty = true;
+	return true;
+}
+
+/// <returns>The frame of the page, or frames.size() if the shard has no frames</returns>
+size_t BlockCache::Fetch(Shard& shard, BinDisk& disk, size_t start, size_t length)
+{
+	auto found = shard.index.find({ &disk, start });
+	if (found != shard.index.end())
+	{
+		++shard.stats.hits;
+		shard.frames[found->second].referenced = true;
+		return found->second;
+	}
+	++shard.stats.misses;
+	if (shard.frames.empty()) return shard.frames.size();
+
+	size_t frame = Victim(shard);
+	disk.GetBytes(start, PageData(shard, frame), length);
+	shard.frames[frame] = { &disk, start, length, true, false };
+	shard.index[{ &disk, start }] = frame;
+	return frame;
+}
+/// <summary>
+/// CLOCK: sweeps the frames, clearing reference bits, until it finds a free or unreferenced one.
+/// </summary>
+size_t BlockCache::Victim(Shard& shard)
+{
+	while (true)
+	{
+		Frame& f = shard.frames[shard.hand];
+		size_t frame = shard.hand;
+		shard.hand = (shard.hand + 1) % shard.frames.size();
+		if (!f.disk) return frame;
+		if (f.referenced)
+		{
+			f.referenced = false;
+			continue;
+		}
+		WriteBack(shard, frame);
+		shard.index.erase({ f.disk, f.start });
+		f = Frame();
+		++shard.stats.evictions;
+		return frame;
+	}
+}
+void BlockCache::WriteBack(Shard& shard, size_t frame)
+{
+	Frame& f = shard.frames[frame];
+	if (!f.dirty) return;
+	f.disk->SetBytes(f.start, PageData(shard, frame), f.length);
+	f.dirty = false;
+	++shard.stats.writebacks;
+}
+
+/// <summary>
+/// One batch per shard, written under the shard's lock only.
+/// </summary>
+void BlockCache::Flush(BinDisk& disk)
+{
+	for (Shard& shard : shards)
+	{
+		std::lock_guard<std::mutex> guard(shard.lock);
+		IOBatch batch;
+		for (size_t i = 0; i != shard.frames.size(); ++i)
+			if (shard.frames[i].disk == &disk && shard.frames[i].dirty)
+			{
+				batch.Write(shard.frames[i].start, PageData(shard, i), shard.frames[i].length);
+				shard.frames[i].dirty = false;
+				++shard.stats.writebacks;
+			}
+		if (!batch.Empty()) disk.Submit(batch);
+	}
+}
+void BlockCache::Drop(BinDisk& disk)
+{
+	Flush(disk);
+	for (Shard& shard : shards)
+	{
+		std::lock_guard<std::mutex> guard(shard.lock);
+		for (size_t i = 0; i != shard.frames.size(); ++i)
+			if (shard.frames[i].disk == &disk)
+			{
+				shard.index.erase({ &disk, shard.frames[i].start });
+				shard.frames[i] = Frame();
+			}
+	}
+}
+void BlockCache::Discard(BinDisk& disk, size_t start)
+{
+	Shard& shard = ShardOf(disk, start);
+	std::lock_guard<std::mutex> guard(shard.lock);
+	auto found = shard.index.find({ &disk, start });
+	if (found == shard.index.end()) return;
+	shard.frames[found->second] = Frame();
+	shard.index.erase(found);
+}
+
+/// <summary>
+/// Writes back every dirty page and reallocates the cache for [bytes] of page memory.
+/// A zero budget disables caching: reads and writes go straight to the disk.
+/// </summary>
+void BlockCache::SetBudget(size_t bytes)
+{
+	const size_t pages = bytes / pageSize;
+	for (size_t s = 0; s != SHARDS; ++s)
+	{
+		Shard& shard = shards[s];
+		std::lock_guard<std::mutex> guard(shard.lock);
+		for (size_t i = 0; i != shard.frames.size(); ++i) WriteBack(shard, i);
+		shard.index.clear();
+		shard.frames.assign(pages / SHARDS + (s < pages % SHARDS), Frame());
+		shard.memory.reset(shard.frames.empty() ? nullptr : new char[shard.frames.size() * pageSize]);
+		shard.hand = 0;
+	}
+}
+size_t BlockCache::GetBudget() const
+{
+	size_t pages = 0;
+	for (const Shard& shard : shards)
+	{
+		std::lock_guard<std::mutex> guard(shard.lock);
+		pages += shard.frames.size();
+	}
+	return pages * pageSize;
+}
+BlockCache::Stats BlockCache::GetStats() const
+{
+	Stats total{ 0, 0, 0, 0 };
+	for (const Shard& shard : shards)
+	{
+		std::lock_guard<std::mutex> guard(shard.lock);
+		total.hits += shard.stats.hits;
+		total.misses += shard.stats.misses;
+		total.evictions += shard.stats.evictions;
+		total.writebacks += shard.stats.writebacks;
+	}
+	return total;
+}
@@ -0,0 +1,92 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+class BinDisk;
+
+/* ---BlockCache------------------------------------------------------------ */
+
+/// <summary>
+/// Fixed-capacity write-back cache of metadata pages, shared by all mounted VDisks.
+/// A page is identified by its BinDisk and absolute start; the owner decides the page bounds, so that cached
+/// pages never overlap data that is written around the cache. Eviction follows the CLOCK policy;
+/// dirty pages are written back when evicted, on Flush and on Drop.
+/// The pages are split into SHARDS independent parts by (disk, page run), each with its own lock and its share
+/// of the budget, so a miss that waits for the disk holds up only the pages of its shard.
+/// </summary>
+class BlockCache
+{
+public:
+	struct Stats
+	{
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t evictions;
+		uint64_t writebacks;
+	};
+	inline static size_t DEFAULT_BUDGET = 8 * 1024 * 1024;	// Bytes of page memory
+	inline static const size_t SHARDS = 16;
+	inline static const size_t RUN = 16;		// Neighbouring pages that go to the same shard, so Flush writes them as one transfer
+
+private:
+	struct Frame
+	{
+		BinDisk* disk = nullptr;	// nullptr == free frame
+		size_t start = 0;
+		size_t length = 0;
+		bool referenced = false;
+		bool dirty = false;
+	};
+	struct Key
+	{
+		BinDisk* disk;
+		size_t start;
+		bool operator==(const Key& other) const { return disk == other.disk && start == other.start; };
+	};
+	struct KeyHash
+	{
+		size_t operator()(const Key& k) const { return std::hash<size_t>()(k.start) ^ (std::hash<BinDisk*>()(k.disk) << 1); };
+	};
+
+	struct Shard
+	{
+		std::vector<Frame> frames;
+		std::unique_ptr<char[]> memory;		// frames.size() pages of pageSize bytes
+		std::unordered_map<Key, size_t, KeyHash> index;
+		size_t hand = 0;
+		Stats stats{ 0, 0, 0, 0 };
+		mutable std::mutex lock;
+	};
+
+	size_t pageSize;
+	std::array<Shard, SHARDS> shards;
+
+	Shard& ShardOf(BinDisk& disk, size_t start);
+	char* PageData(Shard& shard, size_t frame) { return shard.memory.get() + frame * pageSize; };
+	size_t Fetch(Shard& shard, BinDisk& disk, size_t start, size_t length);	// Frame holding the page, loaded on a miss
+	size_t Victim(Shard& shard);											// Free or evicted frame
+	void WriteBack(Shard& shard, size_t frame);
+
+public:
+	static BlockCache& Shared();
+
+	bool Read(BinDisk& disk, size_t start, size_t length, size_t offset, char* data, size_t count);
+	bool Write(BinDisk& disk, size_t start, size_t length, size_t offset, const char* data, size_t count);
+
+	void Flush(BinDisk& disk);						// Writes back all dirty pages of the disk as one batch
+	void Drop(BinDisk& disk);						// Flush and forget the pages of the disk, used on unmount
+	void Discard(BinDisk& disk, size_t start);		// Forget a page without writing it back
+
+	void SetBudget(size_t bytes);					// Flushes everything and resizes the cache, split evenly among the shards
+	size_t GetBudget() const;
+	Stats GetStats() const;
+
+	BlockCache(size_t budget, size_t pageSize);
+	BlockCache(const BlockCache&) = delete;
+	BlockCache& operator=(const BlockCache&) = delete;
+	~BlockCache();
+};
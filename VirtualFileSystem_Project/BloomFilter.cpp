@@ -0,0 +1,57 @@
+#include "BloomFilter.h"
+
+#include <algorithm>
+
+/* ---BloomFilter----------------------------------------------------------- */
+
+namespace
+{
+	/// Mixes the FNV state (its high bits are weak) and splits it into the two hashes of double hashing
+	void Probes(uint64_t hash, uint32_t& h1, uint32_t& h2)
+	{
+		hash ^= hash >> 33;
+		hash *= 0xFF51AFD7ED558CCDull;
+		hash ^= hash >> 33;
+		hash *= 0xC4CEB9FE1A85EC53ull;
+		hash ^= hash >> 33;
+		h1 = uint32_t(hash);
+		h2 = uint32_t(hash >> 32) | 1;
+	}
+}
+
+BloomFilter::BloomFilter(size_t keys) :
+	bits(std::max<size_t>(keys * BITS_PER_KEY, 1024)),
+	words(new std::atomic<uint64_t>[(bits + 63) / 64]())
+{
+}
+
+uint64_t BloomFilter::Hash(std::string_view key, uint64_t hash)
+{
+	for (char c : key)
+	{
+		hash ^= uint8_t(c);
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+void BloomFilter::Add(uint64_t hash)
+{
+	uint32_t h1, h2;
+	Probes(hash, h1, h2);
+	for (unsigned i = 0; i != PROBES; ++i)
+	{
+		size_t bit = (h1 + uint64_t(i) * h2) % bits;
+		words[bit / 64].fetch_or(1ull << (bit % 64), std::memory_order_relaxed);
+	}
+}
+bool BloomFilter::MayContain(uint64_t hash) const
+{
+	uint32_t h1, h2;
+	Probes(hash, h1, h2);
+	for (unsigned i = 0; i != PROBES; ++i)
+	{
+		size_t bit = (h1 + uint64_t(i) * h2) % bits;
+		if (!(words[bit / 64].load(std::memory_order_relaxed) >> (bit % 64) & 1)) return false;
+	}
+	return true;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+/* ---BloomFilter----------------------------------------------------------- */
+
+/// <summary>
+/// Set of path hashes answering "definitely not here" or "maybe here", about 10 bits and 7 probes per key
+/// (1% false positives at the sized number of keys). Keys can't be removed; the filter is rebuilt on mount.
+/// Adding and testing are lock-free, so lookups never wait for a file being created.
+/// </summary>
+class BloomFilter
+{
+public:
+	inline static const uint64_t SEED = 14695981039346656037ull;	// FNV-1a offset basis
+	inline static const unsigned PROBES = 7;
+	inline static const unsigned BITS_PER_KEY = 10;
+
+private:
+	size_t bits;
+	std::unique_ptr<std::atomic<uint64_t>[]> words;
+
+public:
+	/// FNV-1a, continued from [hash]: Hash(b, Hash(a)) == Hash(ab), so a path can be hashed component by component
+	static uint64_t Hash(std::string_view key, uint64_t hash = SEED);
+
+	void Add(uint64_t hash);
+	bool MayContain(uint64_t hash) const;
+
+	explicit BloomFilter(size_t keys = 0);
+};
@@ -0,0 +1,140 @@
+#include "IOPool.h"
+
+#include <algorithm>
+
+/* ---IOPool---------------------------------------------------------------- */
+
+IOPool::~IOPool()
+{
+	Stop();
+}
+
+void IOPool::Start(unsigned threads)
+{
+	if (started.load(std::memory_order_acquire)) return;
+	std::lock_guard<std::mutex> serial(control);
+	std::lock_guard<std::mutex> guard(lock);
+	if (!workers.empty()) return;
+	for (unsigned t = 0; t < std::max(threads, 1u); ++t) workers.emplace_back(&IOPool::Work, this);
+	started.store(true, std::memory_order_release);
+}
+/// <summary>
+/// Queues the task, or parks it behind the task of its strand that is queued or running already.
+/// </summary>
+void IOPool::Push(const void* strand, std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		++unfinished;
+		if (strand)
+		{
+			auto [waiting, first] = strands.try_emplace(strand);
+			if (!first)
+			{
+				waiting->second.push_back(std::move(task));
+				return;
+			}
+		}
+		queue.emplace_back(strand, std::move(task));
+	}
+	wake.notify_one();
+}
+/// <summary>
+/// Runs queued tasks until stopped. A finished task hands its strand to the next task parked on it.
+/// </summary>
+void IOPool::Work()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	while (true)
+	{
+		wake.wait(guard, [this] { return stopping || !queue.empty(); });
+		if (queue.empty()) return;
+		auto [strand, task] = std::move(queue.front());
+		queue.pop_front();
+
+		guard.unlock();
+		task();
+		task = nullptr;		// The task's captures are released before it counts as done
+		guard.lock();
+
+		if (strand)
+		{
+			auto waiting = strands.find(strand);
+			if (waiting->second.empty()) strands.erase(waiting);
+			else
+			{
+				queue.emplace_back(strand, std::move(waiting->second.front()));
+				waiting->second.pop_front();
+			}
+		}
+		if (!--unfinished) idle.notify_all();
+	}
+}
+/// <summary>
+/// Runs task(i) for every i below [count] and returns when all are done; the first error caught is rethrown then.
+/// Idle workers take indices as they come, the calling thread takes the rest instead of waiting for a free worker,
+/// so Run may be called from a task. Without workers the caller runs them all in turn.
+/// </summary>
+void IOPool::Run(unsigned count, const std::function<void(unsigned)>& task)
+{
+	struct State
+	{
+		unsigned next = 0;			// First index not taken
+		unsigned running = 0;		// Taken and not done
+		std::vector<std::exception_ptr> errors;
+		std::mutex lock;
+		std::condition_variable done;
+	};
+	auto state = std::make_shared<State>();
+	state->errors.resize(count);
+	auto runNext = [state, count, &task]		// False once every index is taken; [task] is touched only before that
+	{
+		unsigned i;
+		{
+			std::lock_guard<std::mutex> guard(state->lock);
+			if (state->next == count) return false;
+			i = state->next++;
+			++state->running;
+		}
+		std::exception_ptr error;
+		try { task(i); }
+		catch (...) { error = std::current_exception(); }
+		std::lock_guard<std::mutex> guard(state->lock);
+		state->errors[i] = error;
+		if (!--state->running) state->done.notify_all();
+		return true;
+	};
+
+	bool running;
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		running = !workers.empty();
+	}
+	if (running) for (unsigned i = 1; i < count; ++i) Push(nullptr, [runNext] { runNext(); });
+	while (runNext());
+
+	std::unique_lock<std::mutex> guard(state->lock);
+	state->done.wait(guard, [&] { return !state->running; });
+	for (auto& e : state->errors) if (e) std::rethrow_exception(e);
+}
+void IOPool::Drain()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	idle.wait(guard, [this] { return !unfinished; });
+}
+void IOPool::Stop()
+{
+	std::lock_guard<std::mutex> serial(control);
+	started.store(false, std::memory_order_release);
+	std::vector<std::thread> joined;
+	{
+		std::unique_lock<std::mutex> guard(lock);
+		idle.wait(guard, [this] { return !unfinished || workers.empty(); });
+		stopping = true;
+		joined.swap(workers);
+	}
+	wake.notify_all();
+	for (auto& t : joined) t.join();
+	std::lock_guard<std::mutex> guard(lock);
+	stopping = false;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/* ---IOPool---------------------------------------------------------------- */
+
+/// <summary>
+/// Worker threads running the asynchronous VFS calls. A task may name a strand (the File it works on):
+/// the tasks of one strand run one at a time in the order they were submitted, the others in any order.
+/// The workers are started on demand and stopped with Stop, which runs every queued task first.
+/// </summary>
+class IOPool
+{
+private:
+	std::vector<std::thread> workers;
+	std::deque<std::pair<const void*, std::function<void()>>> queue;		// Tasks ready to run, with their strands
+	std::unordered_map<const void*, std::deque<std::function<void()>>> strands;	// Tasks behind the running one of their strand
+	size_t unfinished = 0;			// Tasks submitted and not done yet
+	bool stopping = false;
+	std::atomic<bool> started{ false };	// Set while the workers run, so Start returns at once then
+	std::mutex lock;
+	std::mutex control;				// Start and Stop one at a time
+	std::condition_variable wake, idle;
+
+	void Push(const void* strand, std::function<void()> task);
+	void Work();
+public:
+	inline static const unsigned DEFAULT_THREADS = 16;
+
+	/// Queues task() and returns the future of its result; an exception thrown by the task is stored in it
+	template<typename F> auto Submit(const void* strand, F task) -> std::future<decltype(task())>
+	{
+		auto packaged = std::make_shared<std::packaged_task<decltype(task())()>>(std::move(task));
+		auto result = packaged->get_future();
+		Push(strand, [packaged] { (*packaged)(); });
+		return result;
+	}
+	void Run(unsigned count, const std::function<void(unsigned)>& task);	// task(0..count-1) on the workers and the caller; rethrows
+	void Start(unsigned threads);	// Does nothing if the workers are running
+	void Drain();					// Waits until every task submitted so far is done; not to be called from a task
+	void Stop();					// Drains and joins the workers
+
+	IOPool() = default;
+	IOPool(const IOPool&) = delete;
+	IOPool& operator=(const IOPool&) = delete;
+	~IOPool();
+};
@@ -0,0 +1,157 @@
+#include "IORing.h"
+#include "IVFS.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define VFS_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
+/* ---IORing---------------------------------------------------------------- */
+
+#ifdef VFS_IO_URING
+
+/// <summary>
+/// Sets up a ring with [depth] submission entries and maps its queues.
+/// </summary>
+/// <returns>nullptr if the kernel doesn't provide io_uring or refuses to set it up</returns>
+std::unique_ptr<IORing> IORing::Create(unsigned depth)
+{
+	io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+	int fd = int(syscall(__NR_io_uring_setup, depth, &params));
+	if (fd < 0) return nullptr;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP))	// Pre-5.4 kernels map the queues separately; not worth supporting
+	{
+		close(fd);
+		return nullptr;
+	}
+
+	size_t ringSize = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+		params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+	void* ringPtr = mmap(nullptr, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ringPtr == MAP_FAILED)
+	{
+		close(fd);
+		return nullptr;
+	}
+	size_t sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	void* sqes = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+	{
+		munmap(ringPtr, ringSize);
+		close(fd);
+		return nullptr;
+	}
+
+	std::unique_ptr<IORing> ring(new IORing());
+	char* base = static_cast<char*>(ringPtr);
+	ring->ringFd = fd;
+	ring->depth = params.sq_entries;
+	ring->sqHead = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+	ring->sqTail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+	ring->sqMask = reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+	ring->sqArray = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+	ring->sqes = sqes;
+	ring->cqHead = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+	ring->cqTail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+	ring->cqMask = reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+	ring->cqes = base + params.cq_off.cqes;
+	ring->ringPtr = ringPtr;
+	ring->ringSize = ringSize;
+	ring->sqesSize = sqesSize;
+	return ring;
+}
+
+/// <summary>
+/// Keeps up to [depth] requests of the batch in flight until all of them complete.
+/// Completed bytes are stored in IORequest::transferred; failed requests are left with 0.
+/// </summary>
+/// <returns>False if the ring itself failed; the caller should finish the batch synchronously</returns>
+bool IORing::Run(int fd, std::vector<IORequest>& batch)
+{
+	io_uring_sqe* sqEntries = static_cast<io_uring_sqe*>(sqes);
+	io_uring_cqe* cqEntries = static_cast<io_uring_cqe*>(cqes);
+	size_t next = 0;
+	unsigned queued = 0, inFlight = 0;
+	bool failed = false;
+
+	while ((!failed && next != batch.size()) || queued || inFlight)
+	{
+		// Fill the submission queue
+		unsigned tail = *sqTail;
+		while (!failed && next != batch.size() && queued + inFlight < depth)
+		{
+			IORequest& r = batch[next];
+			unsigned index = tail & *sqMask;
+			io_uring_sqe& sqe = sqEntries[index];
+			std::memset(&sqe, 0, sizeof(sqe));
+			sqe.opcode = r.write ? IORING_OP_WRITE : IORING_OP_READ;
+			sqe.fd = fd;
+			sqe.off = r.position;
+			sqe.addr = reinterpret_cast<uint64_t>(r.data);
+			sqe.len = unsigned(r.length);
+			sqe.user_data = next;
+			sqArray[index] = index;
+			++tail;
+			++queued;
+			++next;
+		}
+		__atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+
+		// Submit; wait for everything once the whole batch is queued, otherwise for half of the ring to refill it
+		unsigned pending = queued + inFlight;
+		unsigned waitFor = failed || next == batch.size() ? pending : std::max(1u, pending / 2);
+		int submitted = int(syscall(__NR_io_uring_enter, ringFd, queued, waitFor, IORING_ENTER_GETEVENTS, nullptr, 0));
+		if (submitted < 0)
+		{
+			if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			{
+				// Drop what the kernel hasn't consumed yet and only wait for the requests already in flight
+				failed = true;
+				__atomic_store_n(sqTail, __atomic_load_n(sqHead, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+				queued = 0;
+			}
+			submitted = 0;
+		}
+		queued -= unsigned(submitted);
+		inFlight += unsigned(submitted);
+
+		// Reap
+		unsigned head = *cqHead;
+		while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+		{
+			const io_uring_cqe& cqe = cqEntries[head & *cqMask];
+			if (cqe.res > 0) batch[size_t(cqe.user_data)].transferred = size_t(cqe.res);
+			++head;
+			--inFlight;
+		}
+		__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+	}
+	return !failed;
+}
+
+IORing::~IORing()
+{
+	munmap(sqes, sqesSize);
+	munmap(ringPtr, ringSize);
+	close(ringFd);
+}
+
+#else
+
+std::unique_ptr<IORing> IORing::Create(unsigned depth)
+{
+	return nullptr;
+}
+bool IORing::Run(int fd, std::vector<IORequest>& batch)
+{
+	return false;
+}
+IORing::~IORing() {}
+
+#endif
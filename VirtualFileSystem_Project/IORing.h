@@ -0,0 +1,46 @@
+#pragma once
+#include <memory>
+#include <mutex>
+#include <vector>
+
+struct IORequest;
+
+/* ---IORing---------------------------------------------------------------- */
+
+/// <summary>
+/// Minimal io_uring submission/completion ring used by BinDisk to issue a whole batch of positional
+/// transfers with a couple of syscalls. Linux only: elsewhere, and when the kernel refuses to set up
+/// a ring, Create returns nullptr and BinDisk stays on the synchronous path.
+/// </summary>
+class IORing
+{
+private:
+	int ringFd;
+	unsigned depth;
+
+	unsigned* sqHead;
+	unsigned* sqTail;
+	unsigned* sqMask;
+	unsigned* sqArray;
+	void* sqes;				// io_uring_sqe[depth]
+
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned* cqMask;
+	void* cqes;				// io_uring_cqe[]
+
+	void* ringPtr;
+	size_t ringSize;
+	size_t sqesSize;
+
+	IORing() = default;
+public:
+	std::mutex busy;		// A ring serves one batch at a time
+
+	static std::unique_ptr<IORing> Create(unsigned depth);
+	bool Run(int fd, std::vector<IORequest>& batch);	// Returns when every request of the batch has completed
+
+	IORing(const IORing&) = delete;
+	IORing& operator=(const IORing&) = delete;
+	~IORing();
+};
@@ -2,32 +2,93 @@
 
 #include <sstream>
 #include <iostream>
+#include <cstring>
 #include <limits>
 #include <filesystem>
 #include <bitset>
 #include <queue>
+#include <thread>
+#include <functional>
+#include <exception>
+#include <random>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#undef CreateFile	// Clashes with VDisk::CreateFile
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <climits>
+#include <sys/stat.h>
+#include <cerrno>
+#endif
 
 /* ---File------------------------------------------------------------------ */
 
 std::ostream& operator<<(std::ostream& s, const File& node)
 {
-	return s << "[" << node._mainTB << "] "<< node.CountDataBlocks() << " dblocks, " << node._realSize << " bytes" ;
+	if (!node._loaded) return s << "[" << node._mainTB << "] not loaded";
+	return s << "[" << node._mainTB << "] "<< node.CountDataBlocks() << " dblocks in " << node.CountExtents() << " extents, " << node._realSize << " bytes" ;
 }
 
 char File::BuildFileMeta()
 {
-	std::bitset<8> metabitset(_readmode_count);
-	if (_writemode) metabitset.set(4);
+	uint32_t access = _access.load(std::memory_order_acquire);
+	std::bitset<8> metabitset(std::min<uint32_t>(access & ~WRITER, 0b1111));	// The reader count is capped to its 4 bits
+	if (access & WRITER) metabitset.set(4);
+	if (_striped) metabitset.set(5);
 	return static_cast<char>(metabitset.to_ulong());
 }
 
-void File::AddReader()
-{ 
-	_readmode_count = _readmode_count < MAX_READERS ? _readmode_count + 1 : MAX_READERS;
+/// <summary>
+/// The open state is one atomic word, so opening and closing a file never locks and never touches other files.
+/// </summary>
+bool File::TryOpenRead()
+{
+	uint32_t access = _access.load(std::memory_order_relaxed);
+	do
+	{
+		if (access & WRITER || access == WRITER - 1) return false;
+	} while (!_access.compare_exchange_weak(access, access + 1, std::memory_order_acquire, std::memory_order_relaxed));
+	return true;
+}
+bool File::TryOpenWrite()
+{
+	uint32_t closed = 0;
+	return _access.compare_exchange_strong(closed, WRITER, std::memory_order_acquire, std::memory_order_relaxed);
+}
+void File::Release()
+{
+	uint32_t access = _access.load(std::memory_order_relaxed);
+	do
+	{
+		if (!access) return;
+	} while (!_access.compare_exchange_weak(access, access & WRITER ? 0 : access - 1, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void File::SetBuffering(size_t bytes)
+{
+	_buffering = bytes;
+	std::vector<char>().swap(_pending);
+	_pending.reserve(bytes);
+}
+/// <summary>
+/// The read-ahead of the file, made on the first call. Readers calling at once get the same one.
+/// </summary>
+ReadAhead& File::GetReadAhead()
+{
+	ReadAhead* readAhead = _readAhead.load(std::memory_order_acquire);
+	if (readAhead) return *readAhead;
+	auto made = std::make_unique<ReadAhead>();
+	if (_readAhead.compare_exchange_strong(readAhead, made.get(), std::memory_order_acq_rel)) return *made.release();
+	return *readAhead;
 }
-void File::RemoveReader() 
-{ 
-	_readmode_count = _readmode_count > 0 ? _readmode_count - 1 : 0;
+void File::ResetReadAhead()
+{
+	if (ReadAhead* readAhead = _readAhead.load(std::memory_order_acquire)) readAhead->Reset();
 }
 
 /// <returns>The number of blocks needed to be added to fit data</returns>
@@ -38,14 +99,33 @@ uint32_t File::EstimateBlocksNeeded(size_t dataLength) const
 }
 short File::STBCapacity()
 {
-	return BLOCK / ADDR - 1;
+	return (BLOCK - ADDR) / EXTENT;
 }
-/// <returns>Remaining capacity of the active (last) TB</returns>
+/// <returns>Remaining extent slots of the active (last) TB</returns>
 uint32_t File::CountSlotsInTB() const
 {
-	short sTBCap = STBCapacity();
-	short remCap = sTBCap - (blocks.size() + TBDIFF) % sTBCap;
-	return remCap == sTBCap ? 0 : remCap;
+	return uint32_t(titles.size() * STBCapacity() - TBDIFF - extents.size());
+}
+uint32_t File::GetDataBlock(uint32_t index) const
+{
+	size_t i = std::upper_bound(ends.begin(), ends.end(), index) - ends.begin();
+	return extents[i].start + (index - (ends[i] - extents[i].length));
+}
+uint32_t File::GetRunLength(uint32_t index) const
+{
+	return *std::upper_bound(ends.begin(), ends.end(), index) - index;
+}
+void File::AddExtent(uint32_t start, uint32_t length)
+{
+	if (!length) return;
+	if (!extents.empty() && GetLastDataBlock() + 1 == start)
+	{
+		extents.back().length += length;
+		ends.back() += length;
+		return;
+	}
+	extents.push_back({ start, length });
+	ends.push_back(CountDataBlocks() + length);
 }
 
 std::string File::ParseLast(std::string path, char delim) const
@@ -79,32 +159,149 @@ File::File(uint32_t blockAddr, std::string name, std::string fathername)
 	_name = ParseLast(name);
 	_fathername = fathername;
 	_realSize = 0;
-	_writemode = false;
-	_readmode_count = 0;
-	_lastTB = _mainTB = blockAddr;
+	_access = 0;
+	_reserved = { 0, 0 };
+	_striped = false;
+	_buffering = 0;
+	_unsynced = false;
+	_readAhead = nullptr;
+	_mainTB = blockAddr;
+	titles.push_back(blockAddr);
+	_node = 0;
+	_loaded = false;
+}
+File::~File()
+{
+	delete _readAhead.load();
+}
+
+/* ---IOBatch--------------------------------------------------------------- */
+
+void IOBatch::Read(size_t position, char* data, size_t length)
+{
+	if (length) requests.push_back({ position, data, length, false, 0 });
+}
+void IOBatch::Write(size_t position, const char* data, size_t length)
+{
+	// The engine never writes into the buffer of a write request
+	if (length) requests.push_back({ position, const_cast<char*>(data), length, true, 0 });
+}
+void IOBatch::Put(size_t position, uint64_t value, size_t length)
+{
+	auto& bytes = values.emplace_back();
+	PutInt(bytes.data(), value, length);
+	Write(position, bytes.data(), length);
+}
+void IOBatch::Sort()
+{
+	std::stable_sort(requests.begin(), requests.end(), [](const IORequest& a, const IORequest& b) { return a.position < b.position; });
+}
+void IOBatch::Clear()
+{
+	requests.clear();
+	values.clear();
 }
 
 /* ---BinDisk--------------------------------------------------------------- */
 
+BinDisk::BinDisk()
+{
+#ifdef _WIN32
+	handle = INVALID_HANDLE_VALUE;
+	mapping = nullptr;
+#else
+	fd = -1;
+#endif
+	view = nullptr;
+	viewLength = 0;
+}
+BinDisk::~BinDisk()
+{
+	Close();
+}
+
+/// <summary>
+/// Writes [length] bytes at the absolute [position]. Safe to call from several threads for different ranges.
+/// </summary>
+/// <returns>False if the data could not be written completely</returns>
 bool BinDisk::SetBytes(size_t position, const char* data, size_t length)
 {
-	seekp(position, std::ios_base::beg);
-	write(data, length);
+	if (view)
+	{
+		if (position + length > viewLength) return false;
+		std::memcpy(view + position, data, length);
+		return true;
+	}
+	while (length)
+	{
+#ifdef _WIN32
+		OVERLAPPED ov{};
+		ov.Offset = DWORD(position & 0xFFFFFFFF);
+		ov.OffsetHigh = DWORD(uint64_t(position) >> 32);
+		DWORD done = 0;
+		DWORD chunk = DWORD(std::min(length, size_t(UINT32_MAX)));
+		if (!WriteFile(handle, data, chunk, &done, &ov) || !done) return false;
+#else
+		ssize_t done = pwrite(fd, data, length, off_t(position));
+		if (done < 0 && errno == EINTR) continue;
+		if (done <= 0) return false;
+#endif
+		position += done;
+		data += done;
+		length -= done;
+	}
 	return true;
 }
-bool BinDisk::GetBytes(size_t position, char* data, size_t length)
+/// <summary>
+/// Reads [length] bytes from the absolute [position]. Safe to call from several threads.
+/// </summary>
+/// <returns>False if the data could not be read completely</returns>
+bool BinDisk::GetBytes(size_t position, char* data, size_t length) const
 {
-	seekg(position, std::ios_base::beg);
-	read(data, length);
+	if (view)
+	{
+		if (position + length > viewLength) return false;
+		std::memcpy(data, view + position, length);
+		return true;
+	}
+	while (length)
+	{
+#ifdef _WIN32
+		OVERLAPPED ov{};
+		ov.Offset = DWORD(position & 0xFFFFFFFF);
+		ov.OffsetHigh = DWORD(uint64_t(position) >> 32);
+		DWORD done = 0;
+		DWORD chunk = DWORD(std::min(length, size_t(UINT32_MAX)));
+		if (!ReadFile(handle, data, chunk, &done, &ov) || !done) return false;
+#else
+		ssize_t done = pread(fd, data, length, off_t(position));
+		if (done < 0 && errno == EINTR) continue;
+		if (done <= 0) return false;
+#endif
+		position += done;
+		data += done;
+		length -= done;
+	}
 	return true;
 }
 
-void BinDisk::MakeZeroFile(size_t size)
-{
-	char c = char(0b0);
-	while (size--) {
-		this->write(&c, 1);
-	}
+/// <summary>
+/// Sets the file size to [size] bytes without writing them: the unwritten regions read as zeros.
+/// </summary>
+/// <param name="preallocate">Reserve the physical space now instead of leaving the file sparse</param>
+void BinDisk::MakeZeroFile(size_t size, bool preallocate)
+{
+#ifdef _WIN32
+	DWORD returned = 0;
+	if (!preallocate) DeviceIoControl(handle, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &returned, nullptr);
+	LARGE_INTEGER end;
+	end.QuadPart = LONGLONG(size);
+	if (!SetFilePointerEx(handle, end, nullptr, FILE_BEGIN) || !SetEndOfFile(handle))
+		throw std::runtime_error("Failed to resize the file");
+#else
+	if (ftruncate(fd, off_t(size))) throw std::runtime_error("Failed to resize the file");
+	if (preallocate && posix_fallocate(fd, 0, off_t(size))) throw std::runtime_error("Failed to preallocate the file");
+#endif
 }
 /// <summary>
 /// Opens the file in io mode
@@ -112,27 +309,193 @@ void BinDisk::MakeZeroFile(size_t size)
 /// <param name="asNew">Existing file contents will be erased</param>
 void BinDisk::Open(const std::string fileName, bool asNew)
 {
-	auto traits = std::fstream::in | std::fstream::out | std::fstream::binary;
-	if (asNew) traits |= std::fstream::trunc;
-	this->open(fileName, traits);
+	Close();
+#ifdef _WIN32
+	handle = CreateFileA(fileName.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+		asNew ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (handle == INVALID_HANDLE_VALUE) throw std::runtime_error("Failed to open " + fileName);
+#else
+	int flags = O_RDWR;
+	if (asNew) flags |= O_CREAT | O_TRUNC;
+	fd = open(fileName.c_str(), flags, 0644);
+	if (fd < 0) throw std::runtime_error("Failed to open " + fileName);
+#endif
 }
 void BinDisk::Close()
 {
-	this->close();
+	Unmap();
+#ifdef _WIN32
+	if (handle != INVALID_HANDLE_VALUE) CloseHandle(handle);
+	handle = INVALID_HANDLE_VALUE;
+#else
+	if (fd >= 0) close(fd);
+	fd = -1;
+#endif
+}
+bool BinDisk::IsOpen() const
+{
+#ifdef _WIN32
+	return handle != INVALID_HANDLE_VALUE;
+#else
+	return fd >= 0;
+#endif
+}
+/// <summary>
+/// Maps the whole opened file into memory in read-write shared mode.
+/// </summary>
+void BinDisk::Map()
+{
+	if (view) return;
+#ifdef _WIN32
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(handle, &size) || !size.QuadPart) throw std::runtime_error("Cannot map an empty file");
+	mapping = CreateFileMappingA(handle, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+	if (!mapping) throw std::runtime_error("Failed to create file mapping");
+	view = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+	if (!view)
+	{
+		CloseHandle(mapping);
+		mapping = nullptr;
+		throw std::runtime_error("Failed to map the file");
+	}
+	viewLength = size_t(size.QuadPart);
+#else
+	struct stat st;
+	if (fstat(fd, &st) || !st.st_size) throw std::runtime_error("Cannot map an empty file");
+	void* addr = mmap(nullptr, size_t(st.st_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) throw std::runtime_error("Failed to map the file");
+	view = static_cast<char*>(addr);
+	viewLength = size_t(st.st_size);
+#endif
+}
+void BinDisk::Unmap()
+{
+	if (!view) return;
+	Flush();
+#ifdef _WIN32
+	UnmapViewOfFile(view);
+	CloseHandle(mapping);
+	mapping = nullptr;
+#else
+	munmap(view, viewLength);
+#endif
+	view = nullptr;
+	viewLength = 0;
+}
+const char* BinDisk::View(size_t position) const
+{
+	if (!view || position > viewLength) throw std::out_of_range("Position is outside of the mapped file");
+	return view + position;
+}
+/// <summary>
+/// Creates [count] io_uring rings of [depth] entries, so that up to [count] threads submit batches at the same time.
+/// </summary>
+/// <returns>False if io_uring is not available; BinDisk then keeps using the synchronous path</returns>
+bool BinDisk::EnableRings(unsigned depth, unsigned count)
+{
+	rings.clear();
+#ifndef _WIN32
+	for (unsigned i = 0; i != count; ++i)
+	{
+		auto ring = IORing::Create(depth);
+		if (!ring) break;
+		rings.push_back(std::move(ring));
+	}
+#endif
+	return !rings.empty();
+}
+/// <summary>
+/// Issues every request of the batch and waits until all of them complete.
+/// Uses a free io_uring ring when possible; everything the ring didn't finish is done synchronously.
+/// </summary>
+/// <returns>False if any request could not be transferred completely</returns>
+bool BinDisk::Submit(IOBatch& batch)
+{
+	auto& requests = batch.Requests();
+#ifndef _WIN32
+	if (!view && requests.size() > 1)
+		for (auto& ring : rings)
+			if (ring->busy.try_lock())
+			{
+				std::lock_guard<std::mutex> lock(ring->busy, std::adopt_lock);
+				ring->Run(fd, requests);
+				break;
+			}
+#endif
+	if (!view) Coalesce(requests);
+	bool ok = true;
+	for (auto& r : requests)		// What's left: single requests, short and failed transfers
+	{
+		if (r.transferred >= r.length) continue;
+		size_t done = r.transferred;
+		ok &= r.write ? SetBytes(r.position + done, r.data + done, r.length - done) : GetBytes(r.position + done, r.data + done, r.length - done);
+		r.transferred = r.length;
+	}
+	batch.Clear();
+	return ok;
+}
+/// <summary>
+/// Requests that continue each other in the file, though not in memory (stripes, file pieces, cache pages),
+/// are transferred by one preadv/pwritev per run. A short transfer marks what it has done; the rest is left
+/// to the single transfers. Windows has no positional vectored I/O for buffered files, so it does nothing there.
+/// </summary>
+void BinDisk::Coalesce(std::vector<IORequest>& requests)
+{
+#ifndef _WIN32
+	std::vector<iovec> iov;
+	for (size_t i = 0, run; i != requests.size(); i += run)
+	{
+		const IORequest& first = requests[i];
+		size_t end = first.position + first.length;
+		for (run = 1; i + run != requests.size() && run != IOV_MAX; ++run)
+		{
+			const IORequest& r = requests[i + run];
+			if (r.write != first.write || r.position != end || r.transferred || first.transferred) break;
+			end += r.length;
+		}
+		if (run == 1) continue;
+
+		iov.clear();
+		for (size_t j = i; j != i + run; ++j) iov.push_back({ requests[j].data, requests[j].length });
+		ssize_t done = first.write ? pwritev(fd, iov.data(), int(run), off_t(first.position))
+			: preadv(fd, iov.data(), int(run), off_t(first.position));
+		for (size_t j = i; done > 0 && j != i + run; ++j)
+		{
+			requests[j].transferred = std::min(size_t(done), requests[j].length);
+			done -= ssize_t(requests[j].transferred);
+		}
+	}
+#endif
+}
+/// <summary>
+/// Synchronously writes back the dirty mapped pages, or syncs the file data when not mapped.
+/// Everything written before the call is durable after it.
+/// </summary>
+void BinDisk::Flush()
+{
+#ifdef _WIN32
+	if (view) FlushViewOfFile(view, 0);
+	if (handle != INVALID_HANDLE_VALUE) FlushFileBuffers(handle);
+#else
+	if (view) msync(view, viewLength, MS_SYNC);
+	else if (fd >= 0) fdatasync(fd);
+#endif
 }
 
 /* ---VDisk----------------------------------------------------------------- */
 
-std::map<VDisk::Sect, uint32_t> VDisk::addrMap = {
+const std::map<VDisk::Sect, uint32_t> VDisk::layout = {
 // Sections | offset from file begin
 	{Sect::s_data,			0 * ADDR},
-	{Sect::s_nodes,			4 * ADDR},
+	{Sect::s_journal,		DISKDATA},
+	{Sect::s_nodes,			DISKDATA + JOURNAL},
 	{Sect::s_blocks,		-1},		// Depends on file, is updated in VDisk(...)
 // DiskData | offset from s_data begin
 	{Sect::dd_fNodes,		0 * ADDR},
 	{Sect::dd_fBlks,		1 * ADDR},
 	{Sect::dd_maxNode,		2 * ADDR},
 	{Sect::dd_nextFreeBlk,	3 * ADDR},
+	{Sect::dd_nodeMark,		4 * ADDR},
 // NodeData | offset from node's begin
 	{Sect::nd_ncode,		0 * ADDR},
 	{Sect::nd_meta,			1 * ADDR},
@@ -148,121 +511,230 @@ std::map<VDisk::Sect, uint32_t> VDisk::addrMap = {
 uint32_t VDisk::EstimateNodeCapacity(size_t size) const
 {
 	// CLUSTER of BLOCKS is estimated per file by default
-	return uint32_t((size - DISKDATA) / (NODEDATA + CLUSTER * BLOCK));
+	return uint32_t((size - DISKDATA - JOURNAL) / (NODEDATA + CLUSTER * BLOCK));
 }
 uint32_t VDisk::EstimateBlockCapacity(size_t size) const
 {
-	return uint32_t((size - DISKDATA - (size - DISKDATA) / (NODEDATA + CLUSTER * BLOCK) * NODEDATA) / BLOCK);
+	return uint32_t((size - DISKDATA - JOURNAL - EstimateNodeCapacity(size) * NODEDATA) / BLOCK);
 }
 uint64_t VDisk::EstimateMaxSize(uint64_t size) const
 {
-	return uint64_t(DISKDATA + EstimateNodeCapacity(size) * NODEDATA + EstimateBlockCapacity(size) * BLOCK);
+	return uint64_t(DISKDATA + JOURNAL + EstimateNodeCapacity(size) * NODEDATA + EstimateBlockCapacity(size) * BLOCK);
 }
 /// <summary>
-/// Recursively parses data from the Node data section, building tree
+/// Parses the Node data section into the tree.
+/// The section is read in large sequential chunks, or straight from the mapping, and decoded by several threads,
+/// each one taking its own range of nodes. Then each thread links the children of its own share of directories,
+/// so no Vertice is changed by two threads. Emptied nodes below the node mark are collected for reuse.
 /// </summary>
-/// <param name="start_index">The node address to start read. Used to jump between recursion levels</param>
-/// <returns></returns>
-Vertice<File*>* VDisk::LoadHierarchy(uint32_t start_index)
+/// <param name="options">With [lazy], files are left as stubs instead of reading their title blocks</param>
+Vertice<File*>* VDisk::LoadHierarchy(const MountOptions& options)
 {
 	/* Algorithm:
-	1. Add root Vertice for this NC.
-	2. Remember the NC (NodeCode) of node[start_index]: similar NC == children of the same node.
-	3. Go through nodes, starting from start_index, while NC is similar.
-	4.1 If is file, add File.
-	4.2 If is dir, add Dir
-	4.2.1 Call LoadHierarchy(<child's node addr as parameter>) and bind the result to root.
+	1. Decode every used node. A node's NC is the code of its parent directory, the root has code 0.
+	2. Create a Vertice for each directory node, the node's address is the directory's own code.
+	3. Attach files and directories to the Vertice of their NC. Nodes may come in any order.
 	*/
 
-	Vertice<File*>* root = new Vertice<File*>();	// [1]
-	uint32_t curr_nc = GetNodeCode(start_index);	// [2]
+	struct Node
+	{
+		uint32_t parent = 0;
+		bool isFile = true;
+		bool striped = false;
+		std::string name;		// Empty for an empty node
+		uint32_t addr = 0;
+	};
+	const uint32_t count = nodeMark;
+	const uint32_t chunk = 16 * 1024;		// Nodes per read
+	const unsigned workers = std::max(1u, std::min(std::thread::hardware_concurrency(), count / chunk + 1));
+	const uint32_t ncode = addrMap[Sect::nd_ncode], meta = addrMap[Sect::nd_meta], nname = addrMap[Sect::nd_name], naddr = addrMap[Sect::nd_addr];
+
+	// The journal was replayed and checkpointed before, so the file is up to date and the cache can be bypassed
+	std::vector<Node> nodes(count);
+	RunParallel(workers, [&](unsigned w)	// [1]
+	{
+		uint32_t first = uint32_t(uint64_t(count) * w / workers), last = uint32_t(uint64_t(count) * (w + 1) / workers);
+		std::vector<char> buffer;
+		for (uint32_t i = first; i < last; i += chunk)
+		{
+			uint32_t n = std::min(chunk, last - i);
+			size_t pos = std::get<0>(GetPosLen(Sect::s_nodes, i));
+			const char* records;
+			if (disk.IsMapped()) records = disk.View(pos);
+			else
+			{
+				buffer.resize(size_t(n) * NODEDATA);
+				if (!disk.GetBytes(pos, buffer.data(), buffer.size())) throw std::runtime_error("Failed to read the Node data");
+				records = buffer.data();
+			}
+			for (uint32_t j = 0; j != n; ++j)
+			{
+				const char* record = records + size_t(j) * NODEDATA;
+				if (!record[nname]) continue;	// Empty node
+				nodes[i + j] = { CharToInt32(record + ncode), (record[meta] & 0b1000'0000) == 0, (record[meta] & 0b0010'0000) != 0,
+					std::string(record + nname, strnlen(record + nname, NODENAME)), CharToInt32(record + naddr) };
+			}
+		}
+	});
+
+	std::map<uint32_t, Vertice<File*>*> dirs;
+	Vertice<File*>* root = new Vertice<File*>();
+	dirs[0] = root;
+	nextDirCode = 1;
+	freeNodeList.clear();
+	for (uint32_t i = count; i--; )
+		if (nodes[i].name.empty()) freeNodeList.push_back(i);	// The lowest ones are reused first
+	std::map<uint32_t, const Node*> dirNodes;
+	for (const Node& node : nodes)	// [2]
+		if (!node.name.empty() && !node.isFile)
+		{
+			dirs[node.addr] = new Vertice<File*>();
+			dirs[node.addr]->SetCode(node.addr);
+			dirNodes[node.addr] = &node;
+			nextDirCode = std::max(nextDirCode.load(), node.addr + 1);
+		}
 
-	for (uint32_t i = start_index; i != maxNode - freeNodes && curr_nc == GetNodeCode(i); ++i)  // [3]
+	// The filter takes full paths, so each directory gets the hash of its path with the trailing delimiter
+	const std::string_view delimiter(&Vertice<File*>::DELIMITER, 1);
+	std::map<uint32_t, uint64_t> prefixes = { { 0, BloomFilter::SEED } };
+	std::function<uint64_t(uint32_t)> prefixOf = [&](uint32_t code) -> uint64_t
 	{
-		File* node = nullptr;
-		char* filename = ReadInfo(Sect::nd_name, i);
-		uint32_t addr = GetNodeChild(i);
+		auto known = prefixes.find(code);
+		if (known != prefixes.end()) return known->second;
+		auto dir = dirNodes.find(code);
+		if (dir == dirNodes.end()) throw std::runtime_error("Directory " + std::to_string(code) + " is missing");
+		uint64_t hash = BloomFilter::Hash(delimiter, BloomFilter::Hash(dir->second->name, prefixOf(dir->second->parent)));
+		return prefixes[code] = hash;
+	};
+	for (const auto& dir : dirNodes) prefixOf(dir.first);
 
-		bool isFile = GetIsFile(i);
-		if (isFile)
+	std::vector<std::vector<File*>> found(workers);
+	RunParallel(workers, [&](unsigned w)	// [3]
+	{
+		for (uint32_t i = 0; i != count; ++i)
 		{
-			node = new File(addr, filename, this->name);
-			LoadFile(node);
+			const Node& node = nodes[i];
+			if (node.name.empty() || node.parent % workers != w) continue;
+			auto parent = dirs.find(node.parent);
+			if (parent == dirs.end()) throw std::runtime_error("Node " + node.name + " refers to a missing directory");
+			if (node.isFile)
+			{
+				File* f = new File(node.addr, node.name, this->name);
+				f->SetNode(i);
+				if (node.striped) f->MarkStriped();
+				filter.Add(BloomFilter::Hash(node.name, prefixes.at(node.parent)));
+				if (!options.lazy) LoadFile(f);
+				else if (options.prefetch) found[w].push_back(f);
+				parent->second->Add(node.name, f);
+			}
+			else
+				parent->second->BindNewTreeToChild(node.name, dirs.find(node.addr)->second);
 		}
-		root->Add(std::string{ filename }, node);	// [4]
-		if (!isFile)
-			root->BindNewTreeToChild(filename, LoadHierarchy(addr));
-	}
+	});
+	for (auto& part : found) stubs.insert(stubs.end(), part.begin(), part.end());
 
 	return root;
 }
+void VDisk::WriteNode(uint32_t index, const char* node)
+{
+	MetaWrite(std::get<0>(GetPosLen(Sect::s_nodes, index)), node, NODEDATA);
+}
 /// <summary>
-/// Converts tree fo plain array of Node data
+/// Writes the part of the TB chain changed by an allocation: the slots of the extents from [firstExtent] on,
+/// the end-of-list slot, and the whole TBs appended after the first [oldTitles] ones, including the link to them.
+/// The changed range of each TB is encoded from RAM and written at once, so the cost doesn't depend on the file size.
 /// </summary>
-void VDisk::WriteHierarchy()
+void VDisk::UpdateTBs(File* f, uint32_t firstExtent, uint32_t oldTitles)
 {
-	uint32_t nodecode = 0;
-	std::ostringstream info;
-
-	std::vector<char*> nodes;
-	TreeToPlain(nodes, *root, nodecode);
+	const uint32_t capacity = File::STBCapacity(), extents = f->CountExtents(), titles = f->CountTitleBlocks();
+	const uint32_t slotsAt = addrMap[Sect::fd_s_firstDB];
+	uint32_t first = std::min((firstExtent + TBDIFF) / capacity, oldTitles);
+	if (titles > oldTitles && oldTitles) first = std::min(first, oldTitles - 1);	// Its Next TB changes
 
-	uint32_t pos = addrMap[Sect::s_nodes];
-	for (int i = 0; i!= nodes.size(); i++)
+	std::vector<char> tb(BLOCK);
+	for (uint32_t t = first; t != titles; ++t)
 	{
-		disk.SetBytes(pos + i * NODEDATA, nodes[i], NODEDATA);
+		uint32_t addr = f->GetTitleBlock(t);
+		uint32_t from = t * capacity, to = std::min(from + capacity, extents + TBDIFF + 1);	// Global slots, with the end-of-list one
+		uint32_t changed = std::max(from, firstExtent + TBDIFF);
+		size_t lo = (t >= oldTitles || (t + 1 == oldTitles && titles > oldTitles)) ? 0 : slotsAt + (changed - from) * EXTENT;
+		size_t hi = slotsAt + (to - from) * EXTENT;
+
+		PutInt(&tb[addrMap[Sect::fd_nextTB]], t + 1 != titles ? f->GetTitleBlock(t + 1) : addr, ADDR);
+		if (t == 0) PutInt(&tb[addrMap[Sect::fd_realSize]], f->GetSize(), 2 * ADDR);
+		for (uint32_t slot = std::max(from, uint32_t(TBDIFF)); slot != to; ++slot)
+		{
+			char* at = &tb[slotsAt + (slot - from) * EXTENT];
+			if (slot - TBDIFF == extents)	// An empty extent ends the list
+			{
+				PutInt(at, addr, ADDR);
+				PutInt(at + ADDR, 0, ADDR);
+				continue;
+			}
+			PutInt(at, f->GetExtent(slot - TBDIFF).start, ADDR);
+			PutInt(at + ADDR, f->GetExtent(slot - TBDIFF).length, ADDR);
+		}
+		if (lo < hi) MetaWrite(std::get<0>(GetPosLen(Sect::s_blocks, addr)) + lo, &tb[lo], hi - lo);
 	}
 }
-void VDisk::UpdateTBs(File* f)
+void VDisk::PutCounters()
 {
-	uint32_t cur = f->GetMainTB(), next, last = f->GetLastTB();
-	size_t pos, len;
-
-	if (last == cur)	// The case when MainTB is initialized
-	{
-		std::tie(pos, len) = GetPosLen(Sect::fd_nextTB, f->GetMainTB());
-		disk.SetBytes(pos, IntToChar(cur), len);
-	}
-
-	uint32_t totalBlocks = f->CountDataBlocks();
-	uint32_t j, i = 0;
-	while (true)
+	MetaPut(addrMap[Sect::dd_fNodes], freeNodes, ADDR);
+	MetaPut(addrMap[Sect::dd_fBlks], freeBlocks, ADDR);
+	MetaPut(addrMap[Sect::dd_maxNode], maxNode, ADDR);
+	MetaPut(addrMap[Sect::dd_nextFreeBlk], nextFreeBlock, ADDR);
+	MetaPut(addrMap[Sect::dd_nodeMark], nodeMark, ADDR);
+}
+/// <summary>
+/// Called right before a transaction is submitted, under blockReserve: the words carry the latest bits,
+/// so a transaction committed later never brings back an older state of a word.
+/// The words may hold bits of allocations not committed yet; after a crash such blocks stay used, but never
+/// referenced twice, since releases of referenced blocks are committed before the allocation locks are let go.
+/// </summary>
+bool VDisk::PutBitmap()
+{
+	std::vector<uint32_t> dirty = bitmap.TakeDirty();
+	char bytes[2 * ADDR];
+	for (uint32_t w : dirty)
 	{
-		uint32_t count = std::min(totalBlocks-i,uint32_t(File::STBCapacity()));
-		pos = std::get<0>(GetPosLen(Sect::fd_s_firstDB, cur));
-		if (cur == f->GetMainTB()) 
-		{ 
-			pos += TBDIFF * ADDR; 
-			if (count == File::STBCapacity()) count -= TBDIFF;
-		}
-
-		for (j = 0; j < count; ++j)
-			disk.SetBytes(pos + j * ADDR, IntToChar(f->GetDataBlock(i+j)), ADDR);
-		i += count; 
-
-		next = CharToInt32(ReadInfo(Sect::fd_nextTB, cur));
-		if (cur == next)
-		{
-			if (j != File::STBCapacity()) disk.SetBytes(pos + j * ADDR, IntToChar(cur), ADDR);
-			break;
-		}
-		cur = next;
+		Bitmap::Store(bitmap.GetWord(w), bytes);
+		MetaWrite(addrMap[Sect::s_blocks] + size_t(w) * sizeof(uint64_t), bytes, sizeof(uint64_t));
 	}
+	return !dirty.empty();
+}
+/// <summary>
+/// Queues the transaction with the latest counters and bitmap words. They are taken under the allocation locks
+/// together with the submission, so the commit order follows the order the values were taken in.
+/// </summary>
+/// <param name="counters">Writes the counters even if no bitmap word changed</param>
+/// <returns>The ticket to wait for outside the locks</returns>
+uint64_t VDisk::Commit(Journal::Transaction& txn, bool counters)
+{
+	std::lock_guard<std::mutex> lockn(nodeReserve);
+	std::lock_guard<std::mutex> lockb(blockReserve);
+	if (PutBitmap() || counters) PutCounters();
+	return txn.Submit();
+}
+/// <summary>
+/// Reads the whole bitmap in one request, bypassing the cache like LoadHierarchy does, and recounts the free blocks.
+/// </summary>
+void VDisk::LoadBitmap()
+{
+	static_assert(Bitmap::GROUP == BLOCK * BYTE, "A bitmap block holds one summary group");
+	std::vector<char> bytes(bitmap.CountWords() * sizeof(uint64_t));
+	if (!disk.GetBytes(addrMap[Sect::s_blocks], bytes.data(), bytes.size())) throw std::runtime_error("Failed to read the bitmap");
+	bitmap.Load(bytes.data());
+	freeBlocks = bitmap.CountFree();
 }
 /// <summary>
-/// Saves the VDisk stats
+/// Saves the VDisk stats and checkpoints the journal, so that all metadata reaches its home location.
+/// File operations don't call it: they commit to the journal instead.
 /// </summary>
 void VDisk::UpdateDisk()
 {
-	disk.SetBytes(addrMap[Sect::dd_fNodes], IntToChar(freeNodes), ADDR);
-	disk.SetBytes(addrMap[Sect::dd_fBlks], IntToChar(freeBlocks), ADDR);
-	disk.SetBytes(addrMap[Sect::dd_maxNode], IntToChar(maxNode), ADDR);
-	disk.SetBytes(addrMap[Sect::dd_nextFreeBlk], IntToChar(nextFreeBlock), ADDR);
-	WriteHierarchy();
-	// Debug: the fstream is reopened in order to update values in hex editor
-	disk.Close();
-	disk.Open(name);
-	// <- eof Debug
+	PutBitmap();
+	PutCounters();
+	journal.Checkpoint();
 	std::cout << "Disk \"" << name << "\" updated\n";
 }
 /// <summary>
@@ -288,6 +760,7 @@ std::tuple<uint32_t, uint32_t> VDisk::GetPosLen(Sect info, uint32_t offset)
 	case Sect::dd_fBlks:
 	case Sect::dd_maxNode:
 	case Sect::dd_nextFreeBlk:
+	case Sect::dd_nodeMark:
 		pos = addrMap[Sect::s_data] + addrMap[info];
 		len = ADDR;
 		break;
@@ -327,113 +800,201 @@ char* VDisk::ReadInfo(Sect info, uint32_t i)
 	uint32_t pos, len;
 	std::tie(pos, len) = GetPosLen(info, i);
 	char* bytes = new char[len];
-	disk.GetBytes(pos, bytes, len);
+	MetaRead(pos, bytes, len);
 	return bytes;
 }
-
 /// <summary>
-/// Checks for node availability and updates FreeNodes counter
+/// Cache pages follow the VDisk layout: one page for Disk data, BLOCK-sized pages over Node data, clipped where
+/// Block data starts, then exactly one page per block. This way a cached page never overlaps a data block
+/// or the journal, which are written around the cache.
 /// </summary>
-/// <returns>The first free node id</returns>
-uint32_t VDisk::TakeNode(uint32_t size)
+/// <returns>0 - page start, 1 - page length</returns>
+std::tuple<size_t, size_t> VDisk::PageOf(size_t position) const
 {
-	if (freeNodes < size) throw std::logic_error("Failed to find a free node");
-	uint32_t curFree = maxNode - freeNodes;
-	freeNodes -= size;
-	return curFree;
-}
-
-// To rework: doesn't subtracts nodes that already exist
-uint32_t VDisk::EstimateNodes(const std::string_view path)
-{
-	uint32_t count = 1;
-	for (uint32_t i = 0; i < path.size(); i++)
-		if (path[i] == '\\') count++;
-	return count;
+	size_t nodes = addrMap.at(Sect::s_nodes), blocks = addrMap.at(Sect::s_blocks);
+	if (position >= blocks) return std::make_tuple(blocks + (position - blocks) / BLOCK * BLOCK, size_t(BLOCK));
+	if (position >= nodes)
+	{
+		size_t start = nodes + (position - nodes) / BLOCK * BLOCK;
+		return std::make_tuple(start, std::min(size_t(BLOCK), blocks - start));
+	}
+	if (position >= addrMap.at(Sect::s_journal)) throw std::out_of_range("The journal is not cached");
+	return std::make_tuple(size_t(0), size_t(DISKDATA));
 }
-
-void VDisk::UpdateBlockCounters(uint32_t count)
+/// <summary>
+/// Reads metadata through the shared BlockCache. A mapped VDisk is read directly.
+/// </summary>
+void VDisk::MetaRead(size_t position, char* data, size_t length)
 {
-	nextFreeBlock+= count;
-	freeBlocks-=count;
+	if (disk.IsMapped())
+		disk.GetBytes(position, data, length);
+	else
+		for (size_t pos = position, done = 0; done != length; )
+		{
+			size_t start, size;
+			std::tie(start, size) = PageOf(pos);
+			size_t count = std::min(length - done, start + size - pos);
+			BlockCache::Shared().Read(disk, start, size, pos - start, data + done, count);
+			pos += count;
+			done += count;
+		}
+	journal.Overlay(position, data, length);
 }
-
 /// <summary>
-/// Tries to add as many Data Blocks for File f, as specified.
+/// Within a journal transaction the write is only logged: it's applied once the transaction commits.
 /// </summary>
-/// <returns>The number of blocks really allocated</returns>
-uint32_t VDisk::RequestDBlocks(File* f, uint32_t number)
+void VDisk::MetaWrite(size_t position, const char* data, size_t length)
 {
-	uint32_t firstfree, maxTB = 0, maxDB = 0;
-	maxTB = (std::min(number, freeBlocks) - std::min(std::min(f->CountSlotsInTB(), number), freeBlocks)) / File::STBCapacity();
-	maxDB = std::min(std::min(number, freeBlocks - maxTB), f->CountSlotsInTB() + maxTB * (File::STBCapacity() + 1));
-	if (number > maxDB && freeBlocks - maxDB - maxTB > 1) { ++maxTB; maxDB += std::min(freeBlocks - maxDB - maxTB, number - maxDB); }
-	if (maxDB) firstfree = nextFreeBlock;
-	UpdateBlockCounters(maxDB);
-	for (uint32_t i = 0; i < maxDB; ++i) f->AddDataBlock(firstfree + i);
-	for (uint32_t i = 0; i < maxTB; ++i) AppendTB(f, ReserveOneBlock());
-	return maxDB;
+	if (!journal.Log(position, data, length)) MetaApply(position, data, length);
 }
 /// <summary>
-/// Allocates one free block
+/// Writes metadata through the shared BlockCache; it reaches the file on eviction or on a journal checkpoint.
 /// </summary>
-/// <returns>The id of the block </returns>
-uint32_t VDisk::ReserveOneBlock()
+void VDisk::MetaApply(size_t position, const char* data, size_t length)
+{
+	if (disk.IsMapped())
+	{
+		disk.SetBytes(position, data, length);
+		return;
+	}
+	while (length)
+	{
+		size_t start, size;
+		std::tie(start, size) = PageOf(position);
+		size_t count = std::min(length, start + size - position);
+		BlockCache::Shared().Write(disk, start, size, position - start, data, count);
+		position += count;
+		data += count;
+		length -= count;
+	}
+}
+void VDisk::MetaPut(size_t position, uint64_t value, size_t length)
 {
-	if (!freeBlocks) throw std::runtime_error("Failed to get a free block");
-	uint32_t firstfree = nextFreeBlock;
-	UpdateBlockCounters();
-	return firstfree;
+	char bytes[2 * ADDR];
+	PutInt(bytes, value, length);
+	MetaWrite(position, bytes, length);
 }
 
-void VDisk::AppendTB(File* file, uint32_t addr)
+/// <summary>
+/// Checks for node availability and updates FreeNodes counter
+/// </summary>
+/// <returns>Free node ids: emptied nodes first, then the ones above nodeMark</returns>
+std::vector<uint32_t> VDisk::TakeNodes(uint32_t count)
 {
-	disk.SetBytes(addrMap[Sect::s_blocks] + file->GetLastTB() * BLOCK + addrMap[Sect::fd_nextTB], IntToChar(addr), ADDR);
-	file->SetLastTB(addr);
-	disk.SetBytes(addrMap[Sect::s_blocks] + addr * BLOCK + addrMap[Sect::fd_nextTB], IntToChar(addr), ADDR);
+	if (freeNodes < count) throw std::logic_error("Failed to find a free node");
+	std::vector<uint32_t> nodes;
+	for (; nodes.size() != count && !freeNodeList.empty(); freeNodeList.pop_back())
+		nodes.push_back(freeNodeList.back());
+	while (nodes.size() != count) nodes.push_back(nodeMark++);
+	freeNodes -= count;
+	return nodes;
 }
 
-bool VDisk::GetIsFile(short index)
+/// <summary>
+/// Splits the path by Vertice::DELIMITER; the views refer to [path].
+/// </summary>
+std::vector<std::string_view> VDisk::SplitPath(std::string_view path)
 {
-	return (*ReadInfo(Sect::nd_meta, index) & 0b1000'0000) == 0;
+	std::vector<std::string_view> names;
+	for (size_t pos; (pos = path.find(Vertice<File*>::DELIMITER)) != path.npos; path.remove_prefix(pos + 1))
+		names.push_back(path.substr(0, pos));
+	names.push_back(path);
+	return names;
 }
-uint32_t VDisk::GetNodeCode(short index)
+void VDisk::UseBlocks(uint32_t first, uint32_t count)
 {
-	return CharToInt32(ReadInfo(Sect::nd_ncode, index));
+	bitmap.Use(first, count);
+	freeBlocks = bitmap.CountFree();
+	nextFreeBlock = first + count;
 }
-uint32_t VDisk::GetNodeChild(short index)
+void VDisk::ReleaseBlocks(uint32_t first, uint32_t count)
 {
-	return CharToInt32(ReadInfo(Sect::nd_addr, index));
+	bitmap.Release(first, count);
+	freeBlocks = bitmap.CountFree();
 }
+
 /// <summary>
-/// Initializes TB by writing file data to the VDisk
+/// Tries to add as many Data Blocks for File f, as specified. They are handed out from the file's reservation,
+/// a new one is taken when it runs out. The file is written by the caller alone, so only taking a reservation locks.
+/// New title blocks are appended when the last one runs out of slots; they are taken from the reservation too.
 /// </summary>
-/// TO REWORK
-void VDisk::FillTBs(File* file, uint32_t newTBAddr)
+/// <returns>The number of blocks really allocated</returns>
+uint32_t VDisk::RequestDBlocks(File* f, uint32_t number)
 {
-	AppendTB(file, newTBAddr);
-	uint32_t totalBlocks = file->CountDataBlocks();
-	if (file->GetMainTB() == newTBAddr)
+	uint32_t added = 0;
+	while (added != number)
 	{
-		disk.SetBytes(addrMap[Sect::s_blocks] + newTBAddr * BLOCK + addrMap[Sect::fd_realSize], IntToChar(file->GetSize()), 2 * ADDR);
-		for (short i = 0; uint32_t(i) < totalBlocks; ++i)
-			disk.SetBytes(addrMap[Sect::s_blocks] + newTBAddr * BLOCK + addrMap[Sect::fd_firstDB] + i * ADDR, IntToChar(file->GetDataBlock(i)), ADDR);
+		Extent reserved = f->GetReservation();
+		if (!reserved.length)
+		{
+			if (!Reserve(f, number - added)) break;
+			continue;
+		}
+		bool continues = f->CountExtents() && f->GetLastDataBlock() + 1 == reserved.start;
+		if (!continues && !f->CountSlotsInTB())		// The new extent needs a new TB
+		{
+			if (reserved.length < 2 && !freeBlocks) break;	// Nothing would be left for the extent itself
+			f->AddTitleBlock(reserved.start);
+			f->SetReservation({ reserved.start + 1, reserved.length - 1 });
+			continue;
+		}
+		uint32_t take = std::min(reserved.length, number - added);
+		f->AddExtent(reserved.start, take);
+		f->SetReservation({ reserved.start + take, reserved.length - take });
+		added += take;
 	}
-	disk.SetBytes(addrMap[Sect::s_blocks] + newTBAddr * BLOCK + addrMap[Sect::fd_firstDB] + totalBlocks * ADDR, IntToChar(newTBAddr), ADDR);
+	return added;
+}
+/// <summary>
+/// Takes a run of free blocks for the coming appends of the file: right after its last block if that's free,
+/// otherwise in the allocation group of the calling thread. The run grows with the file up to MAX_RESERVATION,
+/// so concurrent appenders take their blocks in large pieces from different places instead of interleaving.
+/// </summary>
+/// <returns>False if the disk is full</returns>
+bool VDisk::Reserve(File* f, uint32_t count)
+{
+	uint32_t length = std::max(count, std::clamp(f->CountDataBlocks(), uint32_t(CLUSTER), MAX_RESERVATION));
+	uint32_t next = f->CountExtents() ? f->GetLastDataBlock() + 1 : bitmap.Size();
+	std::lock_guard<std::mutex> lockb(blockReserve);
+	uint32_t hint = next < bitmap.Size() && !bitmap.IsUsed(next) ? next : GroupStart();
+	auto run = bitmap.FindRun(hint, length);
+	if (!run.second) return false;
+	UseBlocks(run.first, run.second);
+	f->SetReservation({ run.first, run.second });
+	reserving.insert(f);
+	return true;
 }
 /// <summary>
-/// Evaluates blocks needed to fit [len] bytes and allocates them
+/// Gives the unused part of the file's reservation back. The blocks were never referenced by the file,
+/// so they are freed without a commit of their own: the next commit or the unmount stores the bitmap.
 /// </summary>
-/// <returns>True, if the file was expanded</returns>
-bool VDisk::ExpandIfLT(File* f, size_t len)
+void VDisk::ReleaseReservation(File* f)
+{
+	std::lock_guard<std::mutex> lockb(blockReserve);
+	Extent reserved = f->GetReservation();
+	if (reserved.length) ReleaseBlocks(reserved.start, reserved.length);
+	f->SetReservation({ 0, 0 });
+	reserving.erase(f);
+}
+/// <summary>
+/// First block of the allocation group of the calling thread. Threads are numbered in the order of their first
+/// allocation, so concurrent writers start their files in different groups of Bitmap::GROUP blocks.
+/// </summary>
+uint32_t VDisk::GroupStart() const
+{
+	static std::atomic<uint32_t> threads = 0;
+	thread_local const uint32_t thread = threads++;
+	uint32_t groups = (bitmap.Size() + Bitmap::GROUP - 1) / Bitmap::GROUP;
+	return thread % groups * Bitmap::GROUP;
+}
+void VDisk::ExpandIfLT(File* f, size_t len)
 {
 	if (f->GetRemainingSize() < len)
 	{
-		bool changed = RequestDBlocks(f, f->EstimateBlocksNeeded(len)) != 0;
-		UpdateTBs(f);
-		return changed;
+		uint32_t extents = f->CountExtents(), titles = f->CountTitleBlocks();
+		RequestDBlocks(f, f->EstimateBlocksNeeded(len));
+		UpdateTBs(f, extents ? extents - 1 : 0, titles);	// The last extent may have grown
 	}
-	return false;
 }
 
 /*
@@ -457,6 +1018,9 @@ std::ostream& operator<<(std::ostream& s, const VDisk& disk)
 	s << " Free space  :\t" << Aligned(freeSpace, ALIGN) << SEP << disk.sizeInBytes << " bytes (" << ((freeSpace * 1.0) / disk.sizeInBytes) * 100 << "%)\n";
 	s << " Nodes used  :\t" << Aligned(disk.maxNode - disk.freeNodes, ALIGN) << SEP << disk.maxNode << " (" << ((disk.maxNode - disk.freeNodes) * 1.0 / disk.maxNode) * 100 << "%)\n";
 	s << " Blocks used :\t" << Aligned(disk.maxBlock - disk.freeBlocks, ALIGN) << SEP << disk.maxBlock << " (" << ((disk.maxBlock - disk.freeBlocks) * 1.0 / disk.maxBlock) * 100 << "%)\n";
+	auto journal = disk.journal.GetStats();
+	s << " Journal     :\t" << journal.transactions << " transactions in " << journal.groups << " writes, "
+		<< journal.checkpoints << " checkpoints\n";
 	s << "-------->              TREE             <--------\n";
 	s << disk.root->PrintVerticeTree(true);
 	s << "*************************************************\n";
@@ -465,20 +1029,15 @@ std::ostream& operator<<(std::ostream& s, const VDisk& disk)
 }
 
 /// <summary>
-/// Checks if the file exists on disk, tracking down path through the Node section
+/// Checks if the file exists on disk, tracking down path through the Node section.
+/// A stub found on the way is loaded, so the returned file is ready for reading and writing.
 /// </summary>
 /// <returns>File* if file exists, nullptr otherwise</returns>
-File* VDisk::SeekFile(const char* path) const
+File* VDisk::SeekFile(const char* path)
 {
-	try
-	{
-		return (File*)root->GetData(path);
-	}
-	catch (std::logic_error& e)
-	{
-		std::cout << e.what() << std::endl;
-		return nullptr;
-	}
+	File* f = root->Seek(path);
+	if (f) EnsureLoaded(f);
+	return f;
 }
 
 /// <summary>
@@ -486,33 +1045,49 @@ File* VDisk::SeekFile(const char* path) const
 /// </summary>
 void VDisk::LoadFile(File* f)
 {
-	uint32_t main, last, next, addr;
+	uint32_t main, last, next, length;
+	uint64_t size = 0;
 	last = main = f->GetMainTB();
-	char* rawaddr;
-	while (true)	// == through different Title Blocks
+	std::vector<char> tb(BLOCK);
+	while (true)	// == through different Title Blocks, one read per TB
 	{
-		size_t pos = std::get<0>(GetPosLen(Sect::fd_s_firstDB, last));
-		for (short i = 0; i != BLOCK/ADDR-1; ++i)	// == within same Title Block
+		MetaRead(std::get<0>(GetPosLen(Sect::s_blocks, last)), tb.data(), BLOCK);
+		if (last == main) size = CharToInt64(tb.data() + addrMap[Sect::fd_realSize]);
+		const char* slots = tb.data() + addrMap[Sect::fd_s_firstDB];
+		for (short i = last == main ? TBDIFF : 0; i != File::STBCapacity(); ++i)	// == within same Title Block
 		{
-			if (main == last && i < TBDIFF) continue;
-
-			rawaddr = new char[ADDR];
-			disk.GetBytes(pos + i*ADDR, rawaddr, ADDR);
-			addr = CharToInt32(rawaddr);
-			delete[] rawaddr;
-
-			if (addr == main) break;
-
-			f->AddDataBlock(addr);
+			length = CharToInt32(slots + i * EXTENT + ADDR);
+			if (!length) break;
+			f->AddExtent(CharToInt32(slots + i * EXTENT), length);
 		}
 
-		next = CharToInt32(ReadInfo(Sect::fd_nextTB, main));
+		next = CharToInt32(tb.data() + addrMap[Sect::fd_nextTB]);
 		if (next == last) break;
+		f->AddTitleBlock(next);
 		last = next;
 	}
 
-	f->SetLastTB(last);
-	f->IncreaseSize(CharToInt64(ReadInfo(Sect::fd_realSize, main)));
+	f->IncreaseSize(size);
+	f->MarkLoaded();
+}
+void VDisk::EnsureLoaded(File* f)
+{
+	std::lock_guard<std::mutex> guard(loading);
+	if (!f->IsLoaded()) LoadFile(f);
+}
+/// <summary>
+/// Loads the stubs left at mount one by one, until all are loaded or the VDisk is unmounted.
+/// </summary>
+void VDisk::Prefetch()
+{
+	for (size_t i = 0; ; ++i)
+	{
+		std::lock_guard<std::mutex> guard(loading);
+		if (stopPrefetch || i == stubs.size()) break;
+		if (stubs[i] && !stubs[i]->IsLoaded()) LoadFile(stubs[i]);	// Deleted files are nulled
+	}
+	std::lock_guard<std::mutex> guard(loading);
+	stubs.clear();
 }
 
 bool VDisk::CanCreateFile(uint32_t nodes, uint32_t blocks)
@@ -521,29 +1096,90 @@ bool VDisk::CanCreateFile(uint32_t nodes, uint32_t blocks)
 }
 
 /// <summary>
-/// Reserves and initializes space for a new file. 
-/// Writes all data required to the disk.
+/// Reserves and initializes space for a new file. Only the directory of the file is locked while it's created:
+/// nodes and blocks are taken in short steps under the allocation locks, and the wait for the journal comes after
+/// all the locks are released. A missing directory of the path is committed as its own transaction before it
+/// appears in the tree, so a file is never committed ahead of its directory.
 /// </summary>
-File* VDisk::CreateFile(const char* path)
+File* VDisk::CreateFile(const char* path, bool striped)
 {
-	File* f;
-	uint32_t reqNodes = EstimateNodes(path);
+	uint64_t ticket = 0;
+	File* f = AddFile(path, striped, ticket);
+	journal.Wait(ticket);		// Directories may have been committed even if the file was not
+	return f;
+}
+/// <summary>
+/// Creates a file for each path like CreateFile, but waits for the journal once, after the last one:
+/// the commits of all the files are written together.
+/// </summary>
+/// <returns>The files in the order of the paths, nullptr where creating failed</returns>
+std::vector<File*> VDisk::CreateFiles(const std::vector<const char*>& paths)
+{
+	std::vector<File*> files;
+	uint64_t last = 0;
+	for (const char* path : paths)
+	{
+		uint64_t ticket = 0;
+		files.push_back(AddFile(path, false, ticket));
+		last = std::max(last, ticket);
+	}
+	journal.Wait(last);
+	return files;
+}
+/// <summary>
+/// Adds the file and the missing directories to the tree and queues their commits; [ticket] gets the last one.
+/// </summary>
+File* VDisk::AddFile(const char* path, bool striped, uint64_t& ticket)
+{
+	File* f = nullptr;
 	try
 	{
-		std::lock_guard<std::mutex> lockn(nodeReserve);
-		std::lock_guard<std::mutex> lockb(blockReserve);
-		std::lock_guard<std::mutex> lockt(tree);
-		if (CanCreateFile(reqNodes))
+		std::vector<std::string_view> names = SplitPath(path);
+		Vertice<File*>* dir = root;
+		for (size_t i = 0; i + 1 < names.size(); ++i)	// Transit directories
 		{
-			TakeNode(reqNodes);
-			f = new File(ReserveOneBlock(), path, this->name);
-			root->Add(path, f);
-			RequestDBlocks(f, CLUSTER-1);
-			UpdateTBs(f);
-			UpdateDisk();
+			Vertice<File*>* parent = dir;
+			dir = parent->AddDir(names[i], [&]
+			{
+				Journal::Transaction txn(journal);
+				uint32_t node, code = nextDirCode++;
+				{
+					std::lock_guard<std::mutex> lockn(nodeReserve);
+					node = TakeNodes(1).front();
+				}
+				std::unique_ptr<char[]> record(DirToChar(parent->GetCode(), std::string{ names[i] }, code));
+				WriteNode(node, record.get());
+				ticket = Commit(txn);
+				return code;
+			});
 		}
-		else
-			f = nullptr;
+		bool added = dir->AddLeaf(names.back(), [&]
+		{
+			Journal::Transaction txn(journal);
+			uint32_t node;
+			{
+				std::lock_guard<std::mutex> lockn(nodeReserve);
+				std::lock_guard<std::mutex> lockb(blockReserve);
+				if (!CanCreateFile(1)) throw std::logic_error("No space left for " + std::string{ path });
+				node = TakeNodes(1).front();
+				auto run = bitmap.FindRun(GroupStart(), CLUSTER);	// The main TB and the first reservation
+				UseBlocks(run.first, run.second);
+				f = new File(run.first, path, this->name);
+				if (striped) f->MarkStriped();
+				f->SetReservation({ run.first + 1, run.second - 1 });
+				reserving.insert(f);
+			}
+			RequestDBlocks(f, CLUSTER-1);
+			f->SetNode(node);
+			f->MarkLoaded();
+			std::unique_ptr<char[]> record(f->NodeToChar(dir->GetCode()));
+			WriteNode(node, record.get());
+			UpdateTBs(f, 0, 0);
+			ticket = Commit(txn);
+			return f;
+		});
+		if (!added) throw std::logic_error(std::string{ names.back() } + " already exists");
+		filter.Add(BloomFilter::Hash(path));
 	}
 	catch (std::logic_error& e)
 	{
@@ -553,91 +1189,398 @@ File* VDisk::CreateFile(const char* path)
 	return f;
 }
 
-size_t VDisk::WriteInFile(File* f, char* buff, size_t len)
+/// <summary>
+/// Empties the node of a closed file and releases its data and title blocks for reuse.
+/// The allocation locks are held until the transaction is committed: the freed blocks can't be taken by others
+/// before that, and the cached pages of the freed title blocks can be dropped safely afterwards.
+/// The title blocks are revoked in the journal, so a replay doesn't write their old records over a new owner's data.
+/// Directories stay, even if they become empty.
+/// </summary>
+bool VDisk::DeleteFile(File* f, const char* path)
 {
-	ExpandIfLT(f, len);
-	len = std::min(f->GetRemainingSize(), len);
+	std::vector<uint32_t> titles;
+	try
+	{
+		Journal::Transaction txn(journal);
+		std::vector<std::string_view> names = SplitPath(path);
+		Vertice<File*>* dir = root;
+		for (size_t i = 0; i + 1 < names.size(); ++i)
+			if (!(dir = dir->GetDir(names[i]))) throw std::logic_error(std::string{ path } + " not found");
+		dir->Remove(names.back());
+
+		char empty[NODEDATA] = {};
+		WriteNode(f->GetNode(), empty);
+
+		std::lock_guard<std::mutex> lockn(nodeReserve);
+		std::lock_guard<std::mutex> lockb(blockReserve);
+		for (uint32_t i = 0; i != f->CountTitleBlocks(); ++i) titles.push_back(f->GetTitleBlock(i));
+		for (uint32_t i = 0; i != f->CountExtents(); ++i) ReleaseBlocks(f->GetExtent(i).start, f->GetExtent(i).length);
+		for (uint32_t tb : titles)
+		{
+			ReleaseBlocks(tb);
+			journal.Revoke(std::get<0>(GetPosLen(Sect::s_blocks, tb)), BLOCK);	// Its data may come next
+		}
+		freeNodeList.push_back(f->GetNode());
+		++freeNodes;
 
-	size_t pos, wrote = 0;
-	while (wrote!=len)
+		PutBitmap();
+		PutCounters();
+		journal.Wait(txn.Submit());
+		for (uint32_t tb : titles) BlockCache::Shared().Discard(disk, std::get<0>(GetPosLen(Sect::s_blocks, tb)));
+	}
+	catch (std::logic_error& e)
 	{
-		size_t ilen = std::min(size_t(BLOCK - f->Fseekp()), len-wrote);
-		pos = std::get<0>(GetPosLen(Sect::s_blocks, f->GetCurDataBlock())) + f->Fseekp();
-		disk.SetBytes(pos, &buff[wrote], ilen);
-		f->IncreaseSize(ilen);
-		wrote += ilen;
+		std::cout << e.what();
+		return false;
 	}
-	pos = std::get<0>(GetPosLen(Sect::fd_realSize, f->GetMainTB()));
-	disk.SetBytes(pos, IntToChar(f->GetSize()), 2 * ADDR);
-	return wrote;
+	{
+		std::lock_guard<std::mutex> guard(loading);
+		std::replace(stubs.begin(), stubs.end(), f, (File*)nullptr);
+	}
+	delete f;
+	return true;
 }
 
-size_t VDisk::ReadFromFile(File* f, char* buff, size_t len)
+/// <summary>
+/// Appends [len] bytes to the file. The data blocks are issued as one batch; title blocks, the new size and
+/// the counters are committed to the journal afterwards, so the new size never covers unwritten data.
+/// </summary>
+size_t VDisk::WriteInFile(File* f, char* buff, size_t len)
 {
-	len = std::min(f->GetSize(), len);
+	return WriteInFile(f, Pieces{ { buff, len } });
+}
+/// <summary>
+/// Appends the pieces one after another, with one batch and one commit for all of them.
+/// </summary>
+size_t VDisk::WriteInFile(File* f, const Pieces& pieces)
+{
+	IOBatch batch;
+	Journal::Transaction txn(journal);
+	size_t len = 0;
+	for (const auto& piece : pieces) len += piece.second;
+	ExpandIfLT(f, len);
+	size_t wrote = QueueAppend(f, pieces, batch);
+	disk.Submit(batch);
+	MetaPut(std::get<0>(GetPosLen(Sect::fd_realSize, f->GetMainTB())), f->GetSize(), 2 * ADDR);
+	journal.Wait(Commit(txn, false));		// The counters change only along with the bitmap
+	return wrote;
+}
+/// <summary>
+/// Appends to many files at once, each item to the end of its file as WriteInFile does. The data blocks of all
+/// the items go in one batch sorted by position, so neighbouring blocks of different files are written together.
+/// The metadata is committed whenever the transaction reaches a quarter of the journal, and waited for once.
+/// </summary>
+/// <returns>Number of bytes written in total; each item gets its own in [done]</returns>
+size_t VDisk::WriteInFiles(const std::vector<BatchItem*>& items)
+{
+	IOBatch batch;
+	size_t total = 0;
+	uint64_t ticket = 0;
+	for (size_t first = 0, last = 0; first != items.size(); first = last)
+	{
+		Journal::Transaction txn(journal);
+		for (; last != items.size() && txn.Size() < JOURNAL / 4; ++last)
+		{
+			BatchItem& item = *items[last];
+			ExpandIfLT(item.file, item.len);
+			item.done = QueueAppend(item.file, Pieces{ { item.buff, item.len } }, batch);
+			total += item.done;
+		}
+		batch.Sort();
+		disk.Submit(batch);
+		batch.Clear();
+		for (size_t i = first; i != last; ++i)
+			MetaPut(std::get<0>(GetPosLen(Sect::fd_realSize, items[i]->file->GetMainTB())), items[i]->file->GetSize(), 2 * ADDR);
+		ticket = Commit(txn, false);
+	}
+	journal.Wait(ticket);
+	return total;
+}
+/// <returns>Number of bytes queued, as much as the allocated blocks hold</returns>
+size_t VDisk::QueueAppend(File* f, const Pieces& pieces, IOBatch& batch)
+{
+	size_t len = 0;
+	for (const auto& piece : pieces) len += piece.second;
+	len = std::min(f->GetRemainingSize(), len);
+
+	size_t wrote = 0;
+	for (size_t i = 0; wrote != len; ++i)
+	{
+		const char* buff = pieces[i].first;
+		size_t left = std::min(pieces[i].second, len - wrote);
+		while (left)		// One write per extent
+		{
+			uint32_t run = f->GetRunLength(uint32_t(f->GetSize() / BLOCK));
+			size_t ilen = std::min(size_t(run) * BLOCK - f->Fseekp(), left);
+			size_t pos = std::get<0>(GetPosLen(Sect::s_blocks, f->GetCurDataBlock())) + f->Fseekp();
+			batch.Write(pos, buff, ilen);
+			f->IncreaseSize(ilen);
+			buff += ilen;
+			left -= ilen;
+			wrote += ilen;
+		}
+	}
+	return wrote;
+}
+
+/// <summary>
+/// Writes the pieces from [offset] on. The part over the existing data is written in place: the blocks are found
+/// through the extents and nothing is allocated or committed; the file is marked for SyncInPlace instead. The rest
+/// is appended by WriteInFile, whose commit syncs the in-place part as well. A gap past the end of the file reads as zeros.
+/// </summary>
+/// <returns>Number of bytes of the pieces written</returns>
+size_t VDisk::WriteAt(File* f, uint64_t offset, const Pieces& pieces)
+{
+	std::vector<char> zeros;
+	Pieces appended;
+	const uint64_t gap = offset - std::min(offset, f->GetSize());
+	if (gap)
+	{
+		zeros.resize(size_t(std::min<uint64_t>(gap, 64 * BLOCK)));
+		for (uint64_t left = gap; left; left -= appended.back().second)
+			appended.emplace_back(zeros.data(), size_t(std::min<uint64_t>(left, zeros.size())));
+	}
+
+	IOBatch batch;
+	size_t wrote = 0;
+	for (const auto& piece : pieces)
+	{
+		char* buff = piece.first;
+		size_t left = piece.second;
+		while (left && offset < f->GetSize())	// One write per extent
+		{
+			uint32_t index = uint32_t(offset / BLOCK), inner = uint32_t(offset % BLOCK);
+			size_t pos = addrMap[Sect::s_blocks] + size_t(f->GetDataBlock(index)) * BLOCK + inner;
+			size_t ilen = size_t(std::min<uint64_t>({ size_t(f->GetRunLength(index)) * BLOCK - inner, left, f->GetSize() - offset }));
+			batch.Write(pos, buff, ilen);
+			buff += ilen;
+			left -= ilen;
+			offset += ilen;
+			wrote += ilen;
+		}
+		if (left) appended.emplace_back(buff, left);
+	}
+	if (!batch.Empty())
+	{
+		disk.Submit(batch);
+		if (appended.empty()) f->MarkUnsynced();
+	}
+	if (appended.empty()) return wrote;
+	size_t added = WriteInFile(f, appended);
+	return wrote + size_t(added - std::min<uint64_t>(added, gap));
+}
+void VDisk::SyncInPlace(File* f)
+{
+	if (!f->IsUnsynced()) return;
+	disk.Flush();
+	f->MarkUnsynced(false);
+}
+
+/// <summary>
+/// Builds views of the file contents straight over the mapped data blocks, one per contiguous run of blocks.
+/// The views stay valid until the VDisk is unmounted.
+/// </summary>
+std::vector<std::string_view> VDisk::ViewFile(File* f) const
+{
+	if (!disk.IsMapped()) throw std::runtime_error("VDisk \"" + name + "\" is not mapped");
+
+	std::vector<std::string_view> views;
+	size_t left = f->GetSize();
+	for (uint32_t i = 0; left; ++i)
+	{
+		const Extent& e = f->GetExtent(i);
+		size_t ilen = std::min(size_t(e.length) * BLOCK, left);
+		views.emplace_back(disk.View(addrMap.at(Sect::s_blocks) + size_t(e.start) * BLOCK), ilen);
+		left -= ilen;
+	}
+	return views;
+}
+
+size_t VDisk::ReadFromFile(File* f, char* buff, size_t len)
+{
+	IOBatch batch;
+	size_t read = QueueRead(f, buff, len, batch);
+	disk.Submit(batch);
+	return read;
+}
+/// <summary>
+/// Reads the beginning of many files at once: the extents of all the items go in one batch sorted by position.
+/// </summary>
+/// <returns>Number of bytes read in total; each item gets its own in [done]</returns>
+size_t VDisk::ReadFromFiles(const std::vector<BatchItem*>& items)
+{
+	IOBatch batch;
+	size_t total = 0;
+	for (BatchItem* item : items) total += item->done = QueueRead(item->file, item->buff, item->len, batch);
+	batch.Sort();
+	disk.Submit(batch);
+	return total;
+}
+size_t VDisk::QueueRead(File* f, char* buff, size_t len, IOBatch& batch)
+{
+	len = std::min(f->GetSize(), len);
 	size_t read = 0;
-	int i = 0;
-	while (read != len)
+	for (uint32_t i = 0; read != len; ++i)	// One read per extent
 	{
-		size_t pos = addrMap[Sect::s_blocks] + f->GetDataBlock(i) * BLOCK;
-		size_t ilen = std::min(size_t(BLOCK), len - read);
-		disk.GetBytes(pos, &buff[read], ilen);
+		const Extent& e = f->GetExtent(i);
+		size_t pos = addrMap[Sect::s_blocks] + size_t(e.start) * BLOCK;
+		size_t ilen = std::min(size_t(e.length) * BLOCK, len - read);
+		batch.Read(pos, &buff[read], ilen);
 		read += ilen;
-		++i;
 	}
 	return read;
 }
+/// <summary>
+/// Reads the file from [offset] on into the pieces, one after another, as one batch.
+/// A piece that crosses an extent boundary is split there.
+/// </summary>
+/// <returns>Number of bytes read, less than the pieces hold if the file ends first</returns>
+size_t VDisk::ReadFromFile(File* f, uint64_t offset, const Pieces& pieces)
+{
+	size_t len = 0;
+	for (const auto& piece : pieces) len += piece.second;
+	len = size_t(std::min<uint64_t>(f->GetSize() - std::min(f->GetSize(), offset), len));
+
+	IOBatch batch;
+	size_t read = 0;
+	for (size_t i = 0; read != len; ++i)
+	{
+		char* buff = pieces[i].first;
+		size_t left = std::min(pieces[i].second, len - read);
+		while (left)		// One read per extent
+		{
+			uint32_t index = uint32_t(offset / BLOCK), inner = uint32_t(offset % BLOCK);
+			size_t pos = addrMap[Sect::s_blocks] + size_t(f->GetDataBlock(index)) * BLOCK + inner;
+			size_t ilen = std::min(size_t(f->GetRunLength(index)) * BLOCK - inner, left);
+			batch.Read(pos, buff, ilen);
+			buff += ilen;
+			left -= ilen;
+			offset += ilen;
+			read += ilen;
+		}
+	}
+	disk.Submit(batch);
+	return read;
+}
 
 /// Loading existing disk 
-VDisk::VDisk(const std::string fileName):
+VDisk::VDisk(const std::string fileName, const MountOptions& options):
 	name(fileName),
 	sizeInBytes(GetDiskSize(fileName)),
 	maxNode(CharToInt32(OpenAndReadInfo(fileName,addrMap[Sect::dd_maxNode],ADDR))),
-	maxBlock(EstimateBlockCapacity(sizeInBytes))
+	maxBlock(EstimateBlockCapacity(sizeInBytes)),
+	bitmapBlocks((maxBlock + Bitmap::GROUP - 1) / Bitmap::GROUP),
+	filter(maxNode)
 {
-	addrMap[Sect::s_blocks] = DISKDATA + maxNode * NODEDATA;
+	addrMap[Sect::s_blocks] = addrMap[Sect::s_nodes] + maxNode * NODEDATA;
 	disk.Open(fileName);
+	if (options.mapped) disk.Map();
+	else if (options.queueDepth) disk.EnableRings(options.queueDepth, std::max(1u, std::thread::hardware_concurrency()));
+	if (size_t replayed = journal.Replay()) std::cout << "Disk \"" << name << "\": " << replayed << " journal transactions replayed\n";
 	freeNodes = CharToInt32(ReadInfo(Sect::dd_fNodes));
-	freeBlocks = CharToInt32(ReadInfo(Sect::dd_fBlks));
 	nextFreeBlock = CharToInt32(ReadInfo(Sect::dd_nextFreeBlk));
-	root = LoadHierarchy();
+	nodeMark = CharToInt32(ReadInfo(Sect::dd_nodeMark));
+	bitmap = Bitmap(maxBlock);
+	LoadBitmap();
+	root = LoadHierarchy(options);
+	journal.Start();
+	if (options.lazy && options.prefetch) prefetcher = std::thread(&VDisk::Prefetch, this);
 
 	std::cout << "Disk \"" << name << "\" opened\n";
 }
 /// Creating new disk 
-VDisk::VDisk(const std::string fileName, const uint64_t size) :
+VDisk::VDisk(const std::string fileName, const uint64_t size, const MountOptions& options) :
 	name(fileName),
 	maxNode(EstimateNodeCapacity(size)),
 	maxBlock(EstimateBlockCapacity(size)),
-	sizeInBytes(EstimateMaxSize(size))
+	sizeInBytes(EstimateMaxSize(size)),
+	bitmapBlocks((maxBlock + Bitmap::GROUP - 1) / Bitmap::GROUP),
+	filter(maxNode)
 {
-	addrMap[Sect::s_blocks] = DISKDATA + maxNode * NODEDATA;
+	addrMap[Sect::s_blocks] = addrMap[Sect::s_nodes] + maxNode * NODEDATA;
 	disk.Open(fileName, true);
 	root = new Vertice<File*>();
+	nextDirCode = 1;
 
-	disk.MakeZeroFile(sizeInBytes);
+	disk.MakeZeroFile(sizeInBytes, options.provisioning == Provisioning::Preallocated);
+	if (options.mapped) disk.Map();
+	else if (options.queueDepth) disk.EnableRings(options.queueDepth, std::max(1u, std::thread::hardware_concurrency()));
+	journal.Format();
 	freeNodes = maxNode;
-	freeBlocks = maxBlock;
-	nextFreeBlock = 0;
+	nodeMark = 0;
+	bitmap = Bitmap(maxBlock);
+	UseBlocks(0, bitmapBlocks);		// The bitmap occupies the first blocks
+	PutBitmap();					// No transaction yet, goes straight to the cache
 	UpdateDisk();
+	journal.Start();
 	std::cout << "Disk \"" << name << "\" initialized\n";
 }
 VDisk::~VDisk()
 {
+	{
+		std::lock_guard<std::mutex> guard(loading);
+		stopPrefetch = true;
+	}
+	if (prefetcher.joinable()) prefetcher.join();
+	journal.Stop();
+	while (!reserving.empty()) ReleaseReservation(*reserving.begin());	// Files left open for writing
 	UpdateDisk();
+	BlockCache::Shared().Drop(disk);
 	disk.Close();
 	root->Destroy();
 	std::cout << "Disk \"" << name << "\" closed\n";
 }
 
+/* ---Striping-------------------------------------------------------------- */
+
+uint64_t StripeSet::Share(uint64_t size, size_t member) const
+{
+	const uint64_t count = members.size(), full = size / unit;
+	uint64_t share = full / count * unit;
+	if (member < full % count) share += unit;
+	else if (member == full % count) share += size % unit;
+	return share;
+}
+uint64_t StripeSet::Size() const
+{
+	const uint64_t count = members.size();
+	uint64_t first = UINT64_MAX;	// The first stripe that is not complete
+	for (size_t m = 0; m != count; ++m)
+		first = std::min(first, (members[m]->GetSize() - HEADER) / unit * count + m);
+	return first * unit + (members[first % count]->GetSize() - HEADER) - first / count * unit;
+}
+uint64_t StripeSet::Stored() const
+{
+	uint64_t stored = 0;
+	for (const File* member : members) stored += member->GetSize() - HEADER;
+	return stored;
+}
+/// <summary>
+/// Consecutive stripes of a member are consecutive in the member, so each member gets one run from its start.
+/// </summary>
+void StripeSet::Split(uint64_t offset, char* buff, size_t len, std::vector<Pieces>& pieces, std::vector<uint64_t>& starts) const
+{
+	const size_t count = members.size();
+	pieces.assign(count, {});
+	starts.assign(count, 0);
+	for (size_t pos = 0; pos != len; )
+	{
+		uint64_t at = offset + pos, stripe = at / unit;
+		size_t member = size_t(stripe % count), ilen = size_t(std::min<uint64_t>(unit - at % unit, len - pos));
+		if (pieces[member].empty()) starts[member] = HEADER + stripe / count * unit + at % unit;
+		pieces[member].emplace_back(buff + pos, ilen);
+		pos += ilen;
+	}
+}
+
 /* ---VFS------------------------------------------------------------------- */
 
 bool VFS::IsValidSize(size_t size)
 {
-	return (size >= (DISKDATA + NODEDATA + CLUSTER * BLOCK) && size <= UINT32_MAX);
+	return (size >= (DISKDATA + JOURNAL + NODEDATA + (CLUSTER + 1) * BLOCK) && size <= UINT32_MAX);
 }
 
-bool VFS::MountOrCreate(std::string& diskName)
+bool VFS::MountOrCreate(std::string& diskName, const MountOptions& options)
 {
 	bool mountSuccessful = false;
 	
@@ -657,15 +1600,12 @@ bool VFS::MountOrCreate(std::string& diskName)
 			case 'y':
 			{
 				size_t diskSize = 0;
-				std::cout << "Specify size of disk \"" + diskName + "\", bytes (minimum " + std::to_string(DISKDATA + NODEDATA + CLUSTER*BLOCK) + " B)\n> ";
+				std::cout << "Specify size of disk \"" + diskName + "\", bytes (minimum " + std::to_string(DISKDATA + JOURNAL + NODEDATA + (CLUSTER + 1)*BLOCK) + " B)\n> ";
 				std::cin >> diskSize;
 				std::cin.ignore(UINT32_MAX, '\n');
 				std::cin.clear();
-				if (IsValidSize(diskSize))
+				if (CreateAndMount(diskName, diskSize, options))
 				{
-					VDisk* vd = new VDisk(diskName, diskSize);
-					VFS::disks.push_back(vd);
-					std::cout << "Created and mounted disk \"" + diskName + "\" with size " + std::to_string(vd->GetSizeInBytes()) + " B\n";
 					mountSuccessful = true;
 					break;
 				}
@@ -686,19 +1626,49 @@ bool VFS::MountOrCreate(std::string& diskName)
 	else
 	{
 		std::cout << "Mounted disk \"" << diskName << "\" to the VFS\n";
-		VFS::disks.push_back(new VDisk(diskName));
+		VFS::disks.push_back(new VDisk(diskName, options));
+		placement->Update(disks);
 		mountSuccessful = true;
 	}
 
 	return mountSuccessful;
 }
+/// <summary>
+/// Creates a new VDisk of the given size and mounts it without prompting the user.
+/// </summary>
+/// <returns>False if the size is invalid</returns>
+bool VFS::CreateAndMount(const std::string& diskName, uint64_t size, const MountOptions& options)
+{
+	if (!IsValidSize(size)) return false;
+	VDisk* vd = new VDisk(diskName, size, options);
+	VFS::disks.push_back(vd);
+	placement->Update(disks);
+	std::cout << "Created and mounted disk \"" + diskName + "\" with size " + std::to_string(vd->GetSizeInBytes()) + " B\n";
+	return true;
+}
 bool VFS::Unmount(const std::string& diskName)
 {
 	auto disk = GetDisk(diskName);
 	if (disk!=disks.end())
 	{
+		pool.Drain();		// The async calls submitted before may use the disk
+		for (auto& shard : index)
+		{
+			std::unique_lock<std::shared_mutex> guard(shard.access);
+			for (auto entry = shard.paths.begin(); entry != shard.paths.end(); )
+			{
+				bool drop = entry->second.first == *disk;
+				if (StripeSet* set = entry->second.second->GetStripes())
+				{
+					drop = drop || std::find(set->disks.begin(), set->disks.end(), *disk) != set->disks.end();
+					if (drop) entry->second.second->SetStripes(nullptr);	// Found again once all members are mounted
+				}
+				entry = drop ? shard.paths.erase(entry) : std::next(entry);
+			}
+		}
 		delete (*disk);
 		disks.erase(disk);
+		placement->Update(disks);
 		std::cout << "Disk \"" << diskName << "\" was unmounted\n";
 		return true;
 	}
@@ -708,29 +1678,125 @@ bool VFS::Unmount(const std::string& diskName)
 		return false;
 	}
 }
-VDisk* VFS::GetMostFreeDisk()
+/// <summary>
+/// Finds the disk and the file of a full path. A path met once is answered by the index; otherwise only the disks
+/// whose filters may hold the path are searched, so a miss usually touches no tree at all. The disk the placement
+/// policy names as the path's home goes first, so with hashing a hit takes one disk.
+/// </summary>
+/// <returns>{nullptr, nullptr} if no disk has the file</returns>
+std::pair<VDisk*, File*> VFS::Lookup(const char* name)
 {
-	// todo: unsafe; the function doesn't check for full paths whcih may or may not require more than 1 node
-	VDisk* chosenDisk = nullptr;
-	if (disks.size())
+	uint64_t hash = BloomFilter::Hash(name);
+	IndexShard& shard = ShardOf(hash);
 	{
-		uint32_t max_blocks = 0;
-		std::lock_guard<std::mutex> lock(diskSelection);
-		for (const auto& disk : disks)
+		std::shared_lock<std::shared_mutex> guard(shard.access);
+		auto entry = shard.paths.find(name);
+		if (entry != shard.paths.end()) return entry->second;
+	}
+	VDisk* home = placement->Home(name);
+	for (size_t i = 0; i <= disks.size(); ++i)
+	{
+		VDisk* disk = i ? disks[i - 1] : home;
+		if (!disk || (i && disk == home) || !disk->MayContain(hash)) continue;
+		File* file = disk->SeekFile(name);
+		if (!file) continue;
+		std::unique_lock<std::shared_mutex> guard(shard.access);
+		if (file->IsStriped())		// Any member leads to the first one, which stands for the whole file
 		{
-			uint32_t cur_nodes = disk->GetNodesLeft();
-			uint32_t cur_blocks = disk->GetBlocksLeft();
-			if (!cur_nodes || !cur_blocks) continue;
-			if (disk->GetBlocksLeft() > max_blocks)
-			{
-				max_blocks = disk->GetBlocksLeft();
-				chosenDisk = disk;
-			}
+			auto entry = shard.paths.find(name);
+			if (entry != shard.paths.end()) return entry->second;
+			auto first = FindStripes(name, hash, disk, file);
+			if (first.second) shard.paths.emplace(name, first);
+			return first;
 		}
+		shard.paths.emplace(name, std::make_pair(disk, file));
+		return { disk, file };
 	}
-	return chosenDisk;
+	return { nullptr, nullptr };
 }
 
+/// <summary>
+/// Creates the members of a striped file on the VDisks with the most free blocks, each with its header block.
+/// If a member can't be created, the ones created before are deleted.
+/// </summary>
+/// <returns>The first member and its disk; {nullptr, nullptr} if no disk has space left</returns>
+std::pair<VDisk*, File*> VFS::CreateStriped(const char* name, const CreateOptions& options)
+{
+	std::vector<std::pair<uint32_t, VDisk*>> candidates;	// The free blocks are taken once, they change meanwhile
+	for (const auto& disk : disks)
+		if (disk->GetNodesLeft() && disk->GetBlocksLeft()) candidates.emplace_back(disk->GetBlocksLeft(), disk);
+	if (candidates.empty()) return { nullptr, nullptr };
+	std::stable_sort(candidates.begin(), candidates.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+	candidates.resize(std::min<size_t>(options.stripes, candidates.size()));
+
+	auto set = std::make_shared<StripeSet>();
+	set->unit = std::max<uint32_t>(1, (options.stripeSize + BLOCK - 1) / BLOCK) * BLOCK;
+	std::vector<char> header(StripeSet::HEADER);
+	PutInt(&header[0], std::random_device{}(), ADDR);
+	PutInt(&header[2 * ADDR], candidates.size(), ADDR);
+	PutInt(&header[3 * ADDR], set->unit, ADDR);
+	for (const auto& candidate : candidates)
+	{
+		VDisk* disk = candidate.second;
+		File* member = disk->CreateFile(name, true);
+		if (member)
+		{
+			set->disks.push_back(disk);
+			set->members.push_back(member);
+			PutInt(&header[ADDR], set->members.size() - 1, ADDR);
+			if (disk->WriteInFile(member, header.data(), header.size()) == header.size()) continue;
+		}
+		for (size_t m = 0; m != set->members.size(); ++m)
+		{
+			set->disks[m]->ReleaseReservation(set->members[m]);
+			set->disks[m]->DeleteFile(set->members[m], name);
+		}
+		return { candidates.front().second, nullptr };
+	}
+	set->members.front()->SetStripes(set);
+	return { set->disks.front(), set->members.front() };
+}
+/// <summary>
+/// Reads the header of a member of a striped file and finds the other members under the same path on the other
+/// VDisks. Called under the index shard lock of the path, so the set is attached once.
+/// </summary>
+/// <returns>The first member and its disk; {nullptr, nullptr} if some member is not mounted</returns>
+std::pair<VDisk*, File*> VFS::FindStripes(const char* name, uint64_t hash, VDisk* disk, File* member)
+{
+	auto readHeader = [](VDisk* vd, File* f) -> std::array<uint32_t, 4>	// Set id, index, count, stripe size
+	{
+		char header[4 * ADDR];
+		if (vd->ReadFromFile(f, header, sizeof(header)) != sizeof(header)) return {};
+		return { CharToInt32(header), CharToInt32(header + ADDR), CharToInt32(header + 2 * ADDR), CharToInt32(header + 3 * ADDR) };
+	};
+	auto own = readHeader(disk, member);
+	if (own[1] >= own[2] || !own[3]) return { nullptr, nullptr };	// The creation was cut short
+
+	auto set = std::make_shared<StripeSet>();
+	set->disks.resize(own[2]);
+	set->members.resize(own[2]);
+	set->unit = own[3];
+	set->disks[own[1]] = disk;
+	set->members[own[1]] = member;
+	for (const auto& other : disks)
+	{
+		if (other == disk || !other->MayContain(hash)) continue;
+		File* f = other->SeekFile(name);
+		if (!f || !f->IsStriped()) continue;
+		auto header = readHeader(other, f);
+		if (header[0] != own[0] || header[2] != own[2] || header[1] >= own[2]) continue;
+		set->disks[header[1]] = other;
+		set->members[header[1]] = f;
+	}
+	if (std::find(set->members.begin(), set->members.end(), nullptr) != set->members.end()) return { nullptr, nullptr };
+	set->members.front()->SetStripes(set);
+	return { set->disks.front(), set->members.front() };
+}
+void VFS::SetPlacement(std::unique_ptr<PlacementPolicy> policy)
+{
+	placement = std::move(policy);
+	placement->Update(disks);
+}
 std::vector<VDisk*>::iterator VFS::GetDisk(std::string name)
 {
 	for (auto iter = disks.begin(); iter != disks.end(); ++iter)
@@ -748,51 +1814,51 @@ std::vector<VDisk*>::iterator VFS::GetDisk(std::string name)
 File* VFS::Open(const char* name)
 {
 	std::cout << "* Trying to open " << name << " (read mode) -> ";
-	File* file = nullptr;
-	for (const auto& disk : disks)
+	File* file = Lookup(name).second;
+	if (file && file->TryOpenRead())
 	{
-		file = disk->SeekFile(name);
-		std::lock_guard<std::mutex> lock(readAccessCheck);
-		if (file && !(file->IsWriteMode()) && file->GetReaders() < file->MAX_READERS)
-		{
-			file->AddReader();
-			std::cout << "opened" << std::endl;
-			return file;
-		}
+		std::cout << "opened" << std::endl;
+		return file;
 	}
 	std::cout << "failed" << std::endl;
-	return file;
+	return nullptr;
 }
 /// <summary>
 /// Opens or creates the file in writeonly mode. Creates transit directories.
 /// </summary>
 /// <returns>nullptr if the file is already open.</returns>
 File* VFS::Create(const char* name)
+{
+	return Create(name, {});
+}
+/// <summary>
+/// Create with options: with CreateOptions::stripes above 1, a new file is striped over that many VDisks.
+/// An existing file is opened as it is.
+/// </summary>
+File* VFS::Create(const char* name, const CreateOptions& options)
 {
 	std::cout << "* Trying to open " << name << " (write mode) -> ";
 	if (disks.empty()) throw std::out_of_range("No disks mounted");
 
-	File* file = nullptr;
-
 	// Searching for an existing file
-	for (const auto& disk : disks)
-	{
-		file = disk->SeekFile(name);
-		if (file) break;
-	}
+	File* file = Lookup(name).second;
 
 	// Creating new file
 	if (!file)
 	{
 		std::cout << "file not found -> ";
-		VDisk* mostFreeDisk = GetMostFreeDisk();
-		if (mostFreeDisk)
-		{
-			file = mostFreeDisk->CreateFile(name);
+		VDisk* disk = nullptr;
+		if (std::min<size_t>(options.stripes, disks.size()) > 1) std::tie(disk, file) = CreateStriped(name, options);
+		else if ((disk = placement->Place(name))) file = disk->CreateFile(name);
 
-			if (file) std::cout << "created -> ";
-			else std::cout << "failed to create\n";
+		if (file)
+		{
+			IndexShard& shard = ShardOf(BloomFilter::Hash(name));
+			std::unique_lock<std::shared_mutex> guard(shard.access);
+			shard.paths.emplace(name, std::make_pair(disk, file));
+			std::cout << "created -> ";
 		}
+		else if (disk) std::cout << "failed to create\n";
 		else std::cout << "no space left\n";
 	}
 	else std::cout << "file found -> ";
@@ -800,10 +1866,10 @@ File* VFS::Create(const char* name)
 	// Flagging write access
 	if (file)
 	{
-		std::lock_guard<std::mutex> waccess(writeAccessCheck);
-		if (!(file->IsBusy()))
+		if (file->TryOpenWrite())
 		{
-			file->FlipWriteMode();
+			file->SetBuffering(options.writeBuffer);
+			file->ResetReadAhead();
 			std::cout << "opened\n";
 		}
 		else
@@ -816,6 +1882,40 @@ File* VFS::Create(const char* name)
 	return file;
 }
 /// <summary>
+/// Deletes a file that is not open. Its node and blocks are reused by the files created later.
+/// </summary>
+/// <returns>False if the file is not found or busy</returns>
+bool VFS::Delete(const char* name)
+{
+	std::cout << "* Deleting " << name << " -> ";
+	auto [disk, file] = Lookup(name);
+	if (!file)
+	{
+		std::cout << "not found\n";
+		return false;
+	}
+	if (!file->TryOpenWrite())	// Held until the File is gone, so no one can open it in between
+	{
+		std::cout << "is busy\n";
+		return false;
+	}
+	{
+		IndexShard& shard = ShardOf(BloomFilter::Hash(name));
+		std::unique_lock<std::shared_mutex> guard(shard.access);
+		shard.paths.erase(name);
+	}
+	bool deleted = true;
+	if (StripeSet* stripes = file->GetStripes())
+	{
+		StripeSet set = *stripes;	// The first member holds the set and goes last
+		for (size_t m = set.members.size(); m-- > 1; ) deleted = set.disks[m]->DeleteFile(set.members[m], name) && deleted;
+	}
+	deleted = deleted && disk->DeleteFile(file, name);
+	if (!deleted) file->Release();
+	std::cout << (deleted ? "deleted\n" : " -> failed\n");
+	return deleted;
+}
+/// <summary>
 /// Reads bytes starting from the beginning of the file.
 /// </summary>
 /// <returns>Number of bytes actually read</returns>
@@ -826,6 +1926,7 @@ size_t VFS::Read(File* f, char* buff, size_t len)
 		std::cout << "File is open in writemode" << std::endl;
 		return 0;
 	}
+	if (f->GetStripes()) return ReadStriped(f, 0, buff, len);
 	VDisk* vd = (*GetDisk(f->GetFather()));
 	if (!vd) throw std::runtime_error("No disk found for the file");
 	return vd->ReadFromFile(f, buff, len);
@@ -837,33 +1938,414 @@ size_t VFS::Read(File* f, char* buff, size_t len)
 size_t VFS::Write(File* f, char* buff, size_t len)
 {
 	std::cout << "* Writing in file: " << f->GetName() << " -> ";
+	std::vector<char>& pending = f->Pending();
+	if (!f->GetBuffering()) return Append(f, buff, len);
+	if (pending.size() + len < f->GetBuffering())
+	{
+		pending.insert(pending.end(), buff, buff + len);
+		std::cout << "buffered\n";
+		return len;
+	}
+
+	// The buffer is topped up to a block boundary of the file, so the next writes start on a new block
+	const uint64_t size = f->GetStripes() ? f->GetStripes()->Size() : f->GetSize();
+	const size_t held = pending.size();
+	size_t head = std::min(len, size_t(BLOCK - (size + held) % BLOCK) % BLOCK);
+	pending.insert(pending.end(), buff, buff + head);
+	size_t wrote = Append(f, pending.data(), pending.size());
+	pending.erase(pending.begin(), pending.begin() + wrote);
+	if (wrote < held + head)
+	{
+		pending.resize(held - std::min(held, wrote));	// What was accepted before stays for Flush to report
+		std::cout << "no space left\n";
+		return wrote - std::min(held, wrote);
+	}
+
+	// Whole blocks of a large write go straight to VDisk, the tail waits in the buffer
+	size_t direct = (len - head) / BLOCK * BLOCK;
+	if (direct < f->GetBuffering()) direct = 0;
+	if (direct && (wrote = Append(f, buff + head, direct)) < direct) return head + wrote;
+	pending.insert(pending.end(), buff + head + direct, buff + len);
+	return len;
+}
+/// <summary>
+/// Appends without the write buffer: the data, the new title blocks and the size are committed before it returns.
+/// </summary>
+size_t VFS::Append(File* f, char* buff, size_t len)
+{
+	if (f->GetStripes()) return WriteStriped(f, f->GetStripes()->Size(), buff, len);
 	VDisk* vd = (*GetDisk(f->GetFather()));
 	if (!vd) throw std::runtime_error("No disk found for the file");
 	return vd->WriteInFile(f, buff, len);
 }
+/// <summary>
+/// Writes out the appends held by the write buffer of the handle and syncs the blocks WriteAt overwrote in place
+/// since the last Flush. Everything written before is durable when it returns. Close flushes as well and drops
+/// what doesn't fit.
+/// </summary>
+/// <returns>False if not all the buffered bytes fit; they stay buffered</returns>
+bool VFS::Flush(File* f)
+{
+	const bool flushed = WriteOut(f);
+	if (StripeSet* set = f->GetStripes())
+		for (size_t m = 0; m != set->members.size(); ++m) set->disks[m]->SyncInPlace(set->members[m]);
+	else if (f->IsUnsynced())
+	{
+		VDisk* vd = (*GetDisk(f->GetFather()));
+		if (vd) vd->SyncInPlace(f);
+	}
+	return flushed;
+}
+/// <returns>False if not all the buffered bytes fit; they stay buffered</returns>
+bool VFS::WriteOut(File* f)
+{
+	std::vector<char>& pending = f->Pending();
+	if (pending.empty()) return true;
+	std::cout << "* Flushing file: " << f->GetName() << " -> ";
+	pending.erase(pending.begin(), pending.begin() + Append(f, pending.data(), pending.size()));
+	std::cout << (pending.empty() ? "flushed\n" : "no space left\n");
+	return pending.empty();
+}
+/// <summary>
+/// Reads bytes starting from [offset]. Only the blocks holding them are read.
+/// Sequential reads are served by the read-ahead of the file, which prefetches the following blocks.
+/// </summary>
+/// <returns>Number of bytes actually read, 0 past the end of the file</returns>
+size_t VFS::ReadAt(File* f, uint64_t offset, char* buff, size_t len)
+{
+	std::cout << "* Reading file: " << f->GetName() << " at " << offset << " -> ";
+	if (f->IsWriteMode()) {
+		std::cout << "File is open in writemode" << std::endl;
+		return 0;
+	}
+	pool.Start(ioThreads);
+	ReadAhead::Source source;
+	source.pool = &pool;
+	if (f->GetStripes())
+	{
+		source.size = f->GetStripes()->Size();
+		source.read = [this, f](uint64_t at, char* data, size_t count) { return ReadStriped(f, at, data, count); };
+		source.run = [](uint64_t) { return UINT64_MAX; };		// The members are read at once anyway
+	}
+	else
+	{
+		VDisk* vd = (*GetDisk(f->GetFather()));
+		if (!vd) throw std::runtime_error("No disk found for the file");
+		source.size = f->GetSize();
+		source.read = [vd, f](uint64_t at, char* data, size_t count) { return vd->ReadFromFile(f, at, Pieces{ { data, count } }); };
+		source.run = [f](uint64_t at) { return uint64_t(f->GetRunLength(uint32_t(at / BLOCK))) * BLOCK - at % BLOCK; };
+	}
+	return f->GetReadAhead().Read(source, offset, buff, len, readAhead);
+}
+/// <summary>
+/// Writes bytes starting from [offset]: existing data is overwritten in place, the part past the end is appended.
+/// Writing past the end leaves a gap of zeros.
+/// </summary>
+/// <returns>Number of bytes actually written</returns>
+size_t VFS::WriteAt(File* f, uint64_t offset, char* buff, size_t len)
+{
+	if (f->IsWriteMode() && !WriteOut(f)) return 0;
+	std::cout << "* Writing in file: " << f->GetName() << " at " << offset << " -> ";
+	if (!f->IsWriteMode()) {
+		std::cout << "File is not open in writemode" << std::endl;
+		return 0;
+	}
+	if (f->GetStripes()) return WriteStriped(f, offset, buff, len);
+	VDisk* vd = (*GetDisk(f->GetFather()));
+	if (!vd) throw std::runtime_error("No disk found for the file");
+	return vd->WriteAt(f, offset, Pieces{ { buff, len } });
+}
+/// <summary>
+/// Read of a striped file: each member reads its stripes straight into [buff], all members at once on the IOPool.
+/// </summary>
+size_t VFS::ReadStriped(File* f, uint64_t offset, char* buff, size_t len)
+{
+	const StripeSet& set = *f->GetStripes();
+	const uint64_t size = set.Size();
+	len = size_t(std::min<uint64_t>(size - std::min(size, offset), len));
+
+	std::vector<Pieces> pieces;
+	std::vector<uint64_t> starts;
+	set.Split(offset, buff, len, pieces, starts);
+	std::vector<size_t> busy;		// Members with stripes to read
+	for (size_t m = 0; m != pieces.size(); ++m) if (!pieces[m].empty()) busy.push_back(m);
+	Parallel(unsigned(busy.size()), [&](unsigned w)
+	{
+		size_t m = busy[w];
+		set.disks[m]->ReadFromFile(set.members[m], starts[m], pieces[m]);
+	});
+	return len;
+}
+/// <summary>
+/// Write of a striped file. Each member writes its stripes of the data as one call, all members at once.
+/// A gap past the end of the file is written as zeros first.
+/// If a member runs out of space, the file keeps the part that reached all members in order; writing to it
+/// is refused from then on, since the members no longer line up.
+/// </summary>
+size_t VFS::WriteStriped(File* f, uint64_t offset, char* buff, size_t len)
+{
+	const StripeSet& set = *f->GetStripes();
+	const uint64_t size = set.Size();
+	if (size != set.Stored())
+	{
+		std::cout << "the members don't line up, writing is refused\n";
+		return 0;
+	}
+	if (offset > size)
+	{
+		std::vector<char> zeros(size_t(std::min<uint64_t>(offset - size, 64 * BLOCK)));
+		for (uint64_t end = size; end != offset; end += zeros.size())
+		{
+			zeros.resize(size_t(std::min<uint64_t>(offset - end, zeros.size())));
+			if (WriteStriped(f, end, zeros.data(), zeros.size()) != zeros.size()) return 0;
+		}
+	}
+
+	std::vector<Pieces> pieces;
+	std::vector<uint64_t> starts;
+	set.Split(offset, buff, len, pieces, starts);
+	std::vector<size_t> busy;		// Members with stripes to write
+	for (size_t m = 0; m != pieces.size(); ++m) if (!pieces[m].empty()) busy.push_back(m);
+	Parallel(unsigned(busy.size()), [&](unsigned w)
+	{
+		size_t m = busy[w];
+		set.disks[m]->WriteAt(set.members[m], starts[m], pieces[m]);
+	});
+	return size_t(std::min(offset + len, std::max(offset, set.Size())) - offset);
+}
+/// <summary>
+/// Zero-copy counterpart of Read for VDisks mounted with MountOptions::mapped.
+/// </summary>
+/// <returns>Views over the whole file, one per contiguous run of data blocks; empty if the file is open in writemode</returns>
+std::vector<std::string_view> VFS::ReadView(File* f)
+{
+	std::cout << "* Viewing file: " << f->GetName() << " -> ";
+	if (f->IsWriteMode()) {
+		std::cout << "File is open in writemode" << std::endl;
+		return {};
+	}
+	if (f->GetStripes()) throw std::runtime_error("A striped file can't be viewed");
+	auto vd = GetDisk(f->GetFather());
+	if (vd == disks.end()) throw std::runtime_error("No disk found for the file");
+	auto views = (*vd)->ViewFile(f);
+	std::cout << views.size() << " views" << std::endl;
+	return views;
+}
 void VFS::Close(File* f)
 {
 	if (!f) return;
+	if (f->IsWriteMode()) Flush(f);
 	std::cout << "* Closing file: " << f->GetName() << " -> ";
-	if (f->IsBusy())
+	if (f->IsWriteMode())
 	{
-		if (f->IsWriteMode())
+		f->SetBuffering(0);
+		if (StripeSet* set = f->GetStripes())
+			for (size_t m = 0; m != set->members.size(); ++m) set->disks[m]->ReleaseReservation(set->members[m]);
+		else
 		{
-			f->FlipWriteMode();
-			std::cout << "writing closed\n";
+			VDisk* vd = (*GetDisk(f->GetFather()));
+			if (vd) vd->ReleaseReservation(f);
 		}
+		f->Release();
+		std::cout << "writing closed\n";
+	}
+	else if (f->IsBusy())
+	{
+		f->Release();
+		if (!f->IsBusy()) f->ResetReadAhead();
+		std::cout << f->GetReaders() << " readers remain\n";
+	}
+}
+
+/* ---Batch calls----------------------------------------------------------- */
+
+/// <summary>
+/// Create for many names at once. The new files are created by CreateFiles, one call per VDisk with the VDisks
+/// in parallel, so each VDisk waits for its journal once; the path index is updated one shard at a time.
+/// Striped files are created one by one.
+/// </summary>
+/// <returns>The files open for writing in the order of the names; nullptr where Create would return it</returns>
+std::vector<File*> VFS::CreateBatch(const std::vector<std::string>& names, const CreateOptions& options)
+{
+	if (std::min<size_t>(options.stripes, disks.size()) > 1)
+	{
+		std::vector<File*> files;
+		for (const auto& name : names) files.push_back(Create(name.c_str(), options));
+		return files;
+	}
+	std::cout << "* Creating " << names.size() << " files -> ";
+	if (disks.empty()) throw std::out_of_range("No disks mounted");
+
+	std::vector<File*> files(names.size(), nullptr);
+	std::vector<bool> busy(names.size(), false);		// Met before in the batch, or no space left
+	std::unordered_map<std::string_view, size_t> seen;
+	std::unordered_map<VDisk*, std::vector<size_t>> placed;
+	for (size_t i = 0; i != names.size(); ++i)
+	{
+		if (!seen.emplace(names[i], i).second) busy[i] = true;
+		else if (!(files[i] = Lookup(names[i].c_str()).second))
+		{
+			if (VDisk* disk = placement->Place(names[i])) placed[disk].push_back(i);
+			else busy[i] = true;
+		}
+	}
+
+	std::vector<std::pair<VDisk*, std::vector<size_t>>> groups(placed.begin(), placed.end());
+	RunParallel(unsigned(groups.size()), [&](unsigned g)
+	{
+		const auto& [disk, which] = groups[g];
+		std::vector<const char*> paths;
+		for (size_t i : which) paths.push_back(names[i].c_str());
+		std::vector<File*> made = disk->CreateFiles(paths);
+		for (size_t k = 0; k != which.size(); ++k) files[which[k]] = made[k];
+	});
+
+	std::array<std::vector<std::pair<size_t, VDisk*>>, SHARDS> shards;	// New files by their index shard
+	for (const auto& [disk, which] : groups)
+		for (size_t i : which)
+			if (files[i]) shards[(BloomFilter::Hash(names[i].c_str()) >> 32) % SHARDS].emplace_back(i, disk);
+	for (size_t s = 0; s != SHARDS; ++s)
+	{
+		if (shards[s].empty()) continue;
+		std::unique_lock<std::shared_mutex> guard(index[s].access);
+		for (const auto& [i, disk] : shards[s]) index[s].paths.emplace(names[i], std::make_pair(disk, files[i]));
+	}
+
+	size_t opened = 0;
+	for (size_t i = 0; i != names.size(); ++i)
+	{
+		if (busy[i] || !files[i] || !files[i]->TryOpenWrite())
+		{
+			files[i] = nullptr;
+			continue;
+		}
+		files[i]->SetBuffering(options.writeBuffer);
+		files[i]->ResetReadAhead();
+		++opened;
+	}
+	std::cout << opened << " opened\n";
+	return files;
+}
+/// <summary>
+/// Write for many files at once. The items of plain files without a write buffer are appended by WriteInFiles,
+/// one call per VDisk with the VDisks in parallel; the others go through Write one by one.
+/// The items of one file are appended in their order.
+/// </summary>
+size_t VFS::WriteBatch(std::vector<BatchItem>& items)
+{
+	std::unordered_map<VDisk*, std::vector<BatchItem*>> byDisk;
+	size_t total = 0;
+	for (auto& item : items)
+	{
+		item.done = 0;
+		if (!item.file->IsWriteMode()) continue;
+		if (item.file->GetStripes() || item.file->GetBuffering()) total += item.done = Write(item.file, item.buff, item.len);
+		else
+		{
+			auto disk = GetDisk(item.file->GetFather());
+			if (disk == disks.end()) throw std::runtime_error("No disk found for the file");
+			byDisk[*disk].push_back(&item);
+		}
+	}
+	std::cout << "* Writing in " << items.size() << " files -> ";
+	std::vector<std::pair<VDisk*, std::vector<BatchItem*>>> groups(byDisk.begin(), byDisk.end());
+	RunParallel(unsigned(groups.size()), [&](unsigned g) { groups[g].first->WriteInFiles(groups[g].second); });
+	for (const auto& group : groups) for (BatchItem* item : group.second) total += item->done;
+	std::cout << total << " bytes written\n";
+	return total;
+}
+/// <summary>
+/// Read for many files at once: the beginning of each file, as Read does. The items of plain files are read by
+/// ReadFromFiles, one call per VDisk with the VDisks in parallel; striped files are read one by one.
+/// </summary>
+size_t VFS::ReadBatch(std::vector<BatchItem>& items)
+{
+	std::unordered_map<VDisk*, std::vector<BatchItem*>> byDisk;
+	size_t total = 0;
+	for (auto& item : items)
+	{
+		item.done = 0;
+		if (item.file->IsWriteMode()) continue;
+		if (item.file->GetStripes()) total += item.done = ReadStriped(item.file, 0, item.buff, item.len);
 		else
 		{
-			f->RemoveReader();
-			std::cout << f->GetReaders() <<" readers remain\n";
+			auto disk = GetDisk(item.file->GetFather());
+			if (disk == disks.end()) throw std::runtime_error("No disk found for the file");
+			byDisk[*disk].push_back(&item);
 		}
 	}
+	std::cout << "* Reading " << items.size() << " files -> ";
+	std::vector<std::pair<VDisk*, std::vector<BatchItem*>>> groups(byDisk.begin(), byDisk.end());
+	RunParallel(unsigned(groups.size()), [&](unsigned g) { groups[g].first->ReadFromFiles(groups[g].second); });
+	for (const auto& group : groups) for (BatchItem* item : group.second) total += item->done;
+	std::cout << total << " bytes read\n";
+	return total;
+}
+
+/* ---Async calls----------------------------------------------------------- */
+
+// Each call runs its blocking counterpart on the IOPool. The calls on one File use it as their strand,
+// so they run one at a time in the order they were made; Open and Create copy the path first.
+
+std::future<File*> VFS::OpenAsync(const char* name)
+{
+	return Async(nullptr, [this, path = std::string(name)] { return Open(path.c_str()); });
+}
+std::future<File*> VFS::CreateAsync(const char* name)
+{
+	return CreateAsync(name, {});
+}
+std::future<File*> VFS::CreateAsync(const char* name, const CreateOptions& options)
+{
+	return Async(nullptr, [this, path = std::string(name), options] { return Create(path.c_str(), options); });
+}
+std::future<size_t> VFS::ReadAsync(File* f, char* buff, size_t len)
+{
+	return Async(f, [=] { return Read(f, buff, len); });
+}
+std::future<size_t> VFS::WriteAsync(File* f, char* buff, size_t len)
+{
+	return Async(f, [=] { return Write(f, buff, len); });
+}
+std::future<size_t> VFS::ReadAtAsync(File* f, uint64_t offset, char* buff, size_t len)
+{
+	return Async(f, [=] { return ReadAt(f, offset, buff, len); });
+}
+std::future<size_t> VFS::WriteAtAsync(File* f, uint64_t offset, char* buff, size_t len)
+{
+	return Async(f, [=] { return WriteAt(f, offset, buff, len); });
+}
+std::future<void> VFS::CloseAsync(File* f)
+{
+	return Async(f, [=] { Close(f); });
+}
+std::future<bool> VFS::FlushAsync(File* f)
+{
+	return Async(f, [=] { return Flush(f); });
+}
+/// <summary>
+/// Sets the number of IOPool workers, that is how many async calls run at once.
+/// </summary>
+void VFS::SetIOThreads(unsigned threads)
+{
+	ioThreads = threads;
+	pool.Stop();
 }
 
 void VFS::PrintAll()
 {
 	for (auto iter = disks.begin(); iter != disks.end(); ++iter)
 		std::cout << *(*iter);
+	auto stats = GetCacheStats();
+	uint64_t total = stats.hits + stats.misses;
+	std::cout << "Block cache: " << stats.hits << " hits, " << stats.misses << " misses ("
+		<< (total ? stats.hits * 100.0 / total : 0.0) << "% hit rate), "
+		<< stats.evictions << " evictions, " << stats.writebacks << " writebacks\n";
+	auto ahead = GetReadAheadStats();
+	total = ahead.hits + ahead.misses;
+	std::cout << "Read-ahead: " << ahead.hits << " hits, " << ahead.misses << " misses ("
+		<< (total ? ahead.hits * 100.0 / total : 0.0) << "% hit rate), " << ahead.windows << " windows, "
+		<< ahead.used << " of " << ahead.prefetched << " prefetched bytes used\n";
 }
 
 VFS::VFS()
@@ -872,6 +2354,7 @@ VFS::VFS()
 }
 VFS::~VFS()
 {
+	pool.Stop();
 	for (auto iter = disks.begin(); iter != disks.end(); ++iter)
 	{
 		delete (*iter);
@@ -881,6 +2364,22 @@ VFS::~VFS()
 
 /* ---Misc------------------------------------------------------------------ */
 
+/// <summary>
+/// Runs task(w) for every w below [workers]: w = 0 on the calling thread, each other one on a thread of its own.
+/// Returns when all are done; the first error caught is rethrown then.
+/// </summary>
+void RunParallel(unsigned workers, const std::function<void(unsigned)>& task)
+{
+	if (!workers) return;
+	std::vector<std::thread> threads;
+	std::vector<std::exception_ptr> errors(workers);
+	auto run = [&](unsigned w) { try { task(w); } catch (...) { errors[w] = std::current_exception(); } };
+	for (unsigned w = 1; w < workers; ++w) threads.emplace_back(run, w);
+	run(0);
+	for (auto& t : threads) t.join();
+	for (auto& e : errors) if (e) std::rethrow_exception(e);
+}
+
 template<typename T> char* IntToChar(const T& data)
 {
 	const int mask = 0xFF;
@@ -892,6 +2391,14 @@ template<typename T> char* IntToChar(const T& data)
 	}
 	return bytes;
 }
+/// <summary>
+/// Non-allocating IntToChar: encodes the [length] lowest bytes of [value] into [bytes].
+/// </summary>
+void PutInt(char* bytes, uint64_t value, size_t length)
+{
+	for (size_t i = 0; i != length; ++i)
+		bytes[i] = char((value >> ((length - i - 1) * BYTE)) & 0xFF);
+}
 char* StrToChar(const std::string data)
 {
 	char* bytes = new char[data.length() + 1];
@@ -945,43 +2452,7 @@ uint64_t GetDiskSize(std::string filename)
 	std::ifstream in(filename, std::ifstream::ate | std::ifstream::binary);
 	return in.tellg();
 }
-/// <summary>
-/// Dirty hack for making two classes that depend on each other - Vertice and VDisk - communicate.
-/// </summary>
-void TreeToPlain(std::vector<char*>& info, Vertice<File*>& tree, uint32_t& nodecode)
-{
-	// !todo: think of better implementation - tree logic should be hidden
-	if (!tree._children.empty())
-	{
-		std::queue<uint32_t> dirs;
-		for (auto iter = tree._children.begin(); iter != tree._children.end(); ++iter)
-		{
-			char* plainnode;
-			if ((*iter).second.first)	// == is file
-			{
-				plainnode = &(*(*((*iter).second.first))->NodeToChar(nodecode));
-			}
-			else
-			{
-				plainnode = nullptr;	// have to update childaddr later
-				dirs.push(uint32_t(info.size()));
-			}
-			info.push_back(plainnode);
-		}
-		uint32_t curdirnode = nodecode;
-		for (auto iter = tree._children.begin(); iter != tree._children.end(); ++iter)
-			if ((*iter).second.second)
-			{
-				auto dirnode = DirToChar(curdirnode, (*iter).first, uint32_t(info.size()));
-				++nodecode;
-				TreeToPlain(info, *(*iter).second.second, nodecode);
-				info.at(dirs.front()) = dirnode;
-				dirs.pop();
-			}
-	}
-}
-
-char* DirToChar(uint32_t nodecode, std::string name, uint32_t firstchild)
+char* DirToChar(uint32_t nodecode, std::string name, uint32_t dircode)
 {
 	char* newNode = new char[NODEDATA];
 	short i, ibyte = 0;
@@ -996,7 +2467,7 @@ char* DirToChar(uint32_t nodecode, std::string name, uint32_t firstchild)
 		newNode[ibyte] = name[i];
 	// File address
 	for (i = 0; i < ADDR; ++i, ++ibyte)
-		newNode[ibyte] = IntToChar(firstchild)[i];
+		newNode[ibyte] = IntToChar(dircode)[i];
 	return newNode;
 }
 
@@ -3,11 +3,28 @@
 #include <vector>
 #include <fstream>
 #include <map>
+#include <set>
 #include <cmath>
 #include <algorithm>
 #include <memory>
 #include <mutex>
+#include <string_view>
+#include <deque>
+#include <array>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+#include <shared_mutex>
+#include <functional>
 #include "Vertice.h"
+#include "IORing.h"
+#include "BlockCache.h"
+#include "Journal.h"
+#include "Bitmap.h"
+#include "BloomFilter.h"
+#include "Placement.h"
+#include "ReadAhead.h"
+#include "IOPool.h"
 
 /* ---Commmon--------------------------------------------------------------- */
 
@@ -15,16 +32,29 @@
 #define BLOCK		1024			// Reserved per block, bytes
 #define CLUSTER		16				// Default blocks estimated per file
 #define ADDR		4				// Address length, bytes
-#define DISKDATA	ADDR*4			// Reserved for disk info, bytes
+#define DISKDATA	ADDR*5			// Reserved for disk info, bytes
+#define JOURNAL		64*BLOCK		// Reserved for the metadata journal, bytes
 #define NODEDATA	64							// Reserved per node, bytes
 #define NODEMETA	1							// Reserved per node metadata, bytes
 #define NODENAME	NODEDATA-2*ADDR-NODEMETA	// Reserved per node name, bytes
-#define TBDIFF		2				// Difference between main and secondary TB, ADDR
+#define EXTENT		(2*ADDR)		// Title block slot: the first block of a run and the run length
+#define TBDIFF		1				// Difference between main and secondary TB, EXTENT slots
 
 // todo: think of better const handling
 
 /* ---File------------------------------------------------------------------ */
 
+struct StripeSet;
+
+/// <summary>
+/// A run of [length] contiguous data blocks starting at block [start].
+/// </summary>
+struct Extent
+{
+	uint32_t start;
+	uint32_t length;
+};
+
 /// <summary>
 /// The complex pointer used for locating file datablocks on VDisk.
 /// On VDisk File is represented by node in node area and by data blocks in data area.
@@ -36,33 +66,57 @@ private:
 	std::string _fathername;
 	std::string _name;
 	uint64_t _realSize;				// Changed after writing, used for calculating position for write data
-	bool _writemode;
-	short _readmode_count;
+	std::atomic<uint32_t> _access;	// Open state: WRITER or the number of readers
+	Extent _reserved;				// Blocks taken for the coming appends, not in the file yet; returned on closing
+	bool _striped;					// Member of a striped file, flagged in the node metadata
+	std::shared_ptr<StripeSet> _stripes;	// Set on the first member once all members are found
+	std::vector<char> _pending;		// Appends held by the write buffer of the handle, not on VDisk yet
+	size_t _buffering;				// Write buffer capacity, bytes; 0 if every Write goes to VDisk at once
+	bool _unsynced;					// Overwritten in place since the last Flush, the blocks are not synced yet
+	std::atomic<ReadAhead*> _readAhead;	// Made on the first ReadAt, shared by the readers
 
 	uint32_t _mainTB;
-	uint32_t _lastTB;
+	std::vector<uint32_t> titles;	// Addresses of the TBs in the chain order, the first one is _mainTB
+
+	uint32_t _node;					// Index of the file's record in the Node data section
+	bool _loaded;					// False for a stub: blocks, size and lastTB are not read from VDisk yet
 
-	std::vector<uint32_t> blocks;
+	std::vector<Extent> extents;	// Data blocks as runs, in the file order
+	std::vector<uint32_t> ends;		// Number of data blocks in the extents up to and including the i-th
 
 	char BuildFileMeta();
 public:
-	inline static short MAX_READERS = 15;
+	inline static const uint32_t WRITER = 1u << 31;
 
 	// Getters
 
 	std::string GetName() const { return _name; };
 	std::string GetFather() const { return _fathername; };
-	bool IsBusy() const { return _writemode || _readmode_count; };
-	bool IsWriteMode() const { return _writemode; };
-	short GetReaders() const { return _readmode_count; };
+	bool IsBusy() const { return _access.load(std::memory_order_acquire) != 0; };
+	bool IsWriteMode() const { return _access.load(std::memory_order_acquire) & WRITER; };
+	uint32_t GetReaders() const { return _access.load(std::memory_order_acquire) & ~WRITER; };
 	uint32_t GetMainTB() const { return _mainTB; };
-	uint32_t GetLastTB() const { return _lastTB; };
+	uint32_t GetLastTB() const { return titles.back(); };
+	uint32_t CountTitleBlocks() const { return uint32_t(titles.size()); };
+	uint32_t GetTitleBlock(uint32_t index) const { return titles[index]; };
 	uint64_t GetSize() const { return _realSize; };
-
-	uint32_t CountDataBlocks() const { return uint32_t(blocks.size()); };
-	uint32_t GetCurDataBlock() const { return uint32_t(blocks[_realSize / BLOCK]); };	// Addr of the last written DB
-	uint32_t GetDataBlock(uint32_t index) const { return blocks[index]; };				// Addr of the index-th DB
-	uint32_t GetLastDataBlock() const { return blocks.back(); };						// Addr of the last allocated DB
+	uint32_t GetNode() const { return _node; };
+	bool IsLoaded() const { return _loaded; };
+	bool IsStriped() const { return _striped; };
+	StripeSet* GetStripes() const { return _stripes.get(); };
+	size_t GetBuffering() const { return _buffering; };
+	bool IsUnsynced() const { return _unsynced; };
+	std::vector<char>& Pending() { return _pending; };
+	ReadAhead& GetReadAhead();
+
+	uint32_t CountDataBlocks() const { return ends.empty() ? 0 : ends.back(); };
+	uint32_t CountExtents() const { return uint32_t(extents.size()); };
+	const Extent& GetExtent(uint32_t index) const { return extents[index]; };
+	Extent GetReservation() const { return _reserved; };
+	uint32_t GetCurDataBlock() const { return GetDataBlock(uint32_t(_realSize / BLOCK)); };	// Addr of the last written DB
+	uint32_t GetDataBlock(uint32_t index) const;										// Addr of the index-th DB
+	uint32_t GetRunLength(uint32_t index) const;										// Contiguous DBs from the index-th one to the end of its extent
+	uint32_t GetLastDataBlock() const { return extents.back().start + extents.back().length - 1; };	// Addr of the last allocated DB
 	static short STBCapacity();
 	uint32_t CountSlotsInTB() const;
 	uint32_t Fseekp() const { return uint32_t(_realSize % BLOCK); };					// Number of the first empty byte from the last block's beginning
@@ -70,10 +124,18 @@ public:
 
 	// Setters
 
-	void FlipWriteMode() { _writemode = !_writemode; };
-	void AddReader();
-	void RemoveReader();
-	void SetLastTB(uint32_t addr) { _lastTB = addr; };
+	bool TryOpenRead();								// Adds a reader unless the file is open for writing
+	bool TryOpenWrite();							// Takes the file for writing if nobody has it open
+	void Release();									// Closes the writer or one of the readers
+	void AddTitleBlock(uint32_t addr) { titles.push_back(addr); };
+	void SetNode(uint32_t node) { _node = node; };
+	void SetReservation(Extent reserved) { _reserved = reserved; };
+	void MarkLoaded() { _loaded = true; };
+	void MarkStriped() { _striped = true; };
+	void SetStripes(std::shared_ptr<StripeSet> stripes) { _stripes = stripes; };
+	void SetBuffering(size_t bytes);				// Flush the pending bytes before changing it
+	void MarkUnsynced(bool unsynced = true) { _unsynced = unsynced; };
+	void ResetReadAhead();							// Frees the prefetched data; the file may change afterwards
 	void IncreaseSize(uint64_t val) { _realSize += val; };
 
 	// Other
@@ -81,33 +143,132 @@ public:
 	uint32_t EstimateBlocksNeeded(size_t dataLength) const;
 	std::string ParseLast(std::string path, char delim = '\\') const;
 	char* NodeToChar(uint32_t nodeCode);
-	void AddDataBlock(uint32_t datablock) { blocks.push_back(datablock); };
+	void AddExtent(uint32_t start, uint32_t length);	// Extends the last extent if the run continues it
 	friend std::ostream& operator<<(std::ostream& s, const File& node);
 
 	// Class
 
 	File() = delete;
 	File(uint32_t blockAddr, std::string name, std::string fathername);
-	~File() {};
+	~File();
 };
 std::ostream& operator<<(std::ostream& s, const File& node);
 
 /* ---BinDisk--------------------------------------------------------------- */
 
-class BinDisk : std::fstream 
+/// <summary>
+/// One positional transfer issued by BinDisk::Submit.
+/// </summary>
+struct IORequest
 {
+	size_t position;
+	char* data;
+	size_t length;
+	bool write;
+	size_t transferred;		// Filled in by the engine; a short transfer is finished synchronously
+};
+
+/// <summary>
+/// Buffers of one file transfer: consecutive in the file, anywhere in memory.
+/// </summary>
+using Pieces = std::vector<std::pair<char*, size_t>>;
+
+/// <summary>
+/// One file of a batch call: the buffer to write from or read into, and the bytes actually transferred.
+/// </summary>
+struct BatchItem
+{
+	File* file;
+	char* buff;
+	size_t len;
+	size_t done = 0;
+};
+
+/// <summary>
+/// Collects the transfers of one VDisk call so that they are issued together.
+/// Values passed to Put are encoded like IntToChar and owned by the batch until it's submitted.
+/// </summary>
+class IOBatch
+{
+private:
+	std::vector<IORequest> requests;
+	std::deque<std::array<char, 2 * ADDR>> values;	// Deque keeps the encoded values in place while growing
+public:
+	void Read(size_t position, char* data, size_t length);
+	void Write(size_t position, const char* data, size_t length);
+	void Put(size_t position, uint64_t value, size_t length);	// Writes the [length] lowest bytes of [value]
+	void Sort();				// Orders the requests by position, so that neighbours go as one transfer
+
+	bool Empty() const { return requests.empty(); };
+	std::vector<IORequest>& Requests() { return requests; };
+	void Clear();
+};
+
+/// <summary>
+/// Positional binary access to the physical file behind a VDisk.
+/// There is no shared cursor: every call carries its own offset, so different threads may read and write
+/// non-overlapping ranges of the same BinDisk concurrently.
+/// When mapped, the whole file is mapped into memory and all reads and writes go through the mapping.
+/// </summary>
+class BinDisk
+{
+private:
+#ifdef _WIN32
+	void* handle;		// HANDLE, kept opaque so that <windows.h> stays out of the header
+	void* mapping;		// File mapping object HANDLE
+#else
+	int fd;
+#endif
+	char* view;			// Start of the mapped file, nullptr if not mapped
+	size_t viewLength;
+	std::vector<std::unique_ptr<IORing>> rings;		// Empty unless the io_uring engine is enabled and available
+
+	void Coalesce(std::vector<IORequest>& requests);	// One vectored call per run of requests continuing each other
 public:
 	bool SetBytes(size_t position, const char* data, size_t length);	// Low-level writing
-	bool GetBytes(size_t position, char* data, size_t length);			// Low-level reading
+	bool GetBytes(size_t position, char* data, size_t length) const;	// Low-level reading
 
-	void MakeZeroFile(size_t size);
+	void MakeZeroFile(size_t size, bool preallocate = false);		// Sparse unless [preallocate]; reads as zeros either way
 
 	void Open(const std::string fileName, bool asNew = false);
 	void Close();
+	bool IsOpen() const;
+
+	void Map();									// Maps the whole file; the file size must not change while mapped
+	void Unmap();
+	bool IsMapped() const { return view; };
+	const char* View(size_t position) const;	// Pointer into the mapping, valid until Unmap()
+	void Flush();								// Makes the written data durable: syncs the file or the mapped pages
+
+	bool EnableRings(unsigned depth, unsigned count);	// Sets up the io_uring engine; false if it's not available
+	bool Submit(IOBatch& batch);						// Issues the whole batch and waits for all of it
+
+	BinDisk();
+	BinDisk(const BinDisk&) = delete;
+	BinDisk& operator=(const BinDisk&) = delete;
+	~BinDisk();
 };
 
 /* ---VDisk----------------------------------------------------------------- */
 
+enum class Provisioning
+{
+	Sparse,				// Only the file size is set; the physical space is taken as blocks get written
+	Preallocated		// The whole file is reserved on the physical disk at once
+};
+
+/// <summary>
+/// Switches applied when a VDisk is mounted or created.
+/// </summary>
+struct MountOptions
+{
+	bool mapped = false;	// Map the VDisk file into memory: enables zero-copy ReadView, UpdateDisk becomes an msync
+	Provisioning provisioning = Provisioning::Sparse;	// Creation only
+	unsigned queueDepth = 0;	// Non-zero enables the io_uring engine with this many entries per ring (Linux only)
+	bool lazy = false;			// Mount with file stubs: a file's blocks are loaded on its first lookup
+	bool prefetch = false;		// With lazy: load the remaining stubs in the background
+};
+
 /// <summary>
 /// VDisk emulates a physical storage within a physical file and is responsible for low-level data management.
 /// Basically, VDisk is only intended to be used internally by the VFS class.
@@ -120,6 +281,7 @@ private:
 	enum class Sect		// Aliases for all key data sections
 	{ 
 		s_data,
+		s_journal,
 		s_nodes,
 		s_blocks,
 
@@ -127,6 +289,7 @@ private:
 		dd_fBlks, 
 		dd_maxNode,
 		dd_nextFreeBlk,
+		dd_nodeMark,
 
 		nd_ncode,
 		nd_meta,
@@ -138,54 +301,82 @@ private:
 		fd_firstDB,		// Address of the first data block
 		fd_s_firstDB	// Address of the first data block in secondary TB
 	};
-	static std::map<Sect, uint32_t> addrMap;	// Offsets for all key data sections in bytes
+	static const std::map<Sect, uint32_t> layout;	// Default offsets for all key data sections in bytes
+	std::map<Sect, uint32_t> addrMap = layout;		// Offsets of this VDisk; s_blocks depends on the node capacity
 
 	const std::string name;
 	const uint64_t sizeInBytes;		// Reserved size provided during creation
 	const uint32_t maxNode;			// The limit on files
 	const uint32_t maxBlock;		// The limit on blocks
-	uint32_t freeNodes;
-	uint32_t freeBlocks;
-	uint32_t nextFreeBlock;
-
-	std::mutex blockReserve, nodeReserve, freeNodeReserve, tree;
+	std::atomic<uint32_t> freeNodes;		// Changed under nodeReserve, read without it
+	std::atomic<uint32_t> freeBlocks;	// Changed under blockReserve, read without it
+	uint32_t nextFreeBlock;			// Where the search for free blocks starts
+	uint32_t nodeMark;				// Nodes below it were used at least once
+	std::atomic<uint32_t> nextDirCode;	// Not stored: restored from the nodes on loading
+	std::vector<uint32_t> freeNodeList;	// Emptied nodes below nodeMark, reused first; restored on loading
+	Bitmap bitmap;					// Free-block bitmap, stored in the first bitmapBlocks blocks
+	const uint32_t bitmapBlocks;
+	BloomFilter filter;				// Paths of the files, for the VFS lookups; rebuilt on loading
+	std::set<File*> reserving;		// Files holding reservations, guarded by blockReserve
+	inline static const uint32_t MAX_RESERVATION = Bitmap::GROUP / 8;	// Blocks taken for a file's appends at once, at most
+
+	std::mutex blockReserve, nodeReserve, freeNodeReserve, loading;	// Tree changes lock only the directory changed
 
 	BinDisk disk;					// Main data in/out stream
+	Journal journal{ disk, layout.at(Sect::s_journal), JOURNAL,
+		[this](size_t position, const char* data, size_t length) { MetaApply(position, data, length); } };
 	Vertice<File*>* root;			// Hierarchy & search
+	std::vector<File*> stubs;		// Files left unloaded at mount, walked by the prefetcher
+	std::thread prefetcher;
+	bool stopPrefetch = false;		// Guarded by loading
 
 	// Uses data in RAM
 
 	uint32_t EstimateNodeCapacity(size_t size) const;
 	uint32_t EstimateBlockCapacity(size_t size) const;
 	uint64_t EstimateMaxSize(uint64_t size) const;		// User's size is truncated so that all blocks are of BLOCK size
-	uint32_t EstimateNodes(const std::string_view path);	
-	uint32_t TakeNode(uint32_t size);					// Reserve one node
+	std::vector<uint32_t> TakeNodes(uint32_t count);	// Reserve [count] nodes, emptied ones first
 	bool CanCreateFile(uint32_t nodes, uint32_t blocks = 2);
 	
 	uint32_t RequestDBlocks(File* f, uint32_t number); 	// Try to allocate [number] of blocks for [f]
-	uint32_t ReserveOneBlock();							// Reserves one block for delayed assignment to a file
-	bool ExpandIfLT(File* f, size_t len);				// Allocate blocks to fit [len] bytes 
-	void UpdateBlockCounters(uint32_t count = 1);
+	bool Reserve(File* f, uint32_t count);				// Takes a new reservation of at least [count] blocks, if possible
+	uint32_t GroupStart() const;						// First block of the calling thread's allocation group
+	void ExpandIfLT(File* f, size_t len);				// Allocate blocks to fit [len] bytes 
+	size_t QueueAppend(File* f, const Pieces& pieces, IOBatch& batch);	// Adds the writes of the pieces at the end, up to the space allocated
+	size_t QueueRead(File* f, char* buff, size_t len, IOBatch& batch);	// Adds the reads of the first [len] bytes
+	File* AddFile(const char* path, bool striped, uint64_t& ticket);		// CreateFile without waiting for the commit
+	void UseBlocks(uint32_t first, uint32_t count = 1);
+	void ReleaseBlocks(uint32_t first, uint32_t count = 1);
+	static std::vector<std::string_view> SplitPath(std::string_view path);
 
 	// Uses BinDisk data directly
 
-	void UpdateTBs(File* f);
+	void UpdateTBs(File* f, uint32_t firstExtent, uint32_t oldTitles);	// Writes the TB slots from [firstExtent] on and the new TBs
+	void PutCounters();									// Writes the Disk data counters
+	bool PutBitmap();									// Writes the bitmap words changed since the last call, if any
+	uint64_t Commit(Journal::Transaction& txn, bool counters = true);	// Submits with the latest counters and bitmap words
+	void LoadBitmap();
 	void UpdateDisk();									// Refreshes data in the associated BinDisk
 
-	Vertice<File*>* LoadHierarchy(uint32_t start_index = 0);	// Plain to tree
-	void WriteHierarchy();										// Tree to plain
+	Vertice<File*>* LoadHierarchy(const MountOptions& options);	// Plain to tree; lazy mounts leave files as stubs
+	void WriteNode(uint32_t index, const char* node);			// Writes one NODEDATA record
 
 	void LoadFile(File* f);
+	void EnsureLoaded(File* f);							// Materializes a stub, safe to call from several threads
+	void Prefetch();
 
-	void AppendTB(File* f, uint32_t addr);
-	void FillTBs(File* f, uint32_t newAddr);
 
 	char* ReadInfo(Sect info, uint32_t i = 0);			// Get raw data from a specific Section
+
+	// Metadata goes through the journal and the shared BlockCache, file data doesn't
+
+	std::tuple<size_t, size_t> PageOf(size_t position) const;	// Start and length of the cache page holding [position]
+	void MetaRead(size_t position, char* data, size_t length);
+	void MetaWrite(size_t position, const char* data, size_t length);	// Logged if the thread runs a journal transaction
+	void MetaApply(size_t position, const char* data, size_t length);	// Unlogged write to the cache
+	void MetaPut(size_t position, uint64_t value, size_t length);	// Writes the [length] lowest bytes of [value]
 	std::tuple<uint32_t, uint32_t> GetPosLen(Sect info, uint32_t offset);	// Converts section offsets to an absolute data position
 	
-	bool GetIsFile(short index);
-	uint32_t GetNodeCode(short index);
-	uint32_t GetNodeChild(short index);
 
 public:
 	std::string GetName() const { return name; };
@@ -193,19 +384,62 @@ public:
 	uint32_t GetBlocksLeft() const { return freeBlocks; };
 	uint32_t GetNodesLeft() const { return freeNodes; };
 
-	File* SeekFile(const char* path) const;					// Seeks for a file without creating it
-	File* CreateFile(const char* path);						// Reserves space for a new file
+	File* SeekFile(const char* path);						// Seeks for a file without creating it, loads a stub
+	bool MayContain(uint64_t pathHash) const { return filter.MayContain(pathHash); };	// False if the path is surely not here
+	File* CreateFile(const char* path, bool striped = false);	// Reserves space for a new file
+	std::vector<File*> CreateFiles(const std::vector<const char*>& paths);	// CreateFile for each path, one wait for the journal
+	bool DeleteFile(File* f, const char* path);				// Frees the node and the blocks of a closed file
+	void ReleaseReservation(File* f);						// Returns the blocks reserved for appends, on closing
 	size_t WriteInFile(File* f, char* buff, size_t len);
+	size_t WriteInFile(File* f, const Pieces& pieces);			// Appends the pieces in order, as one write
+	size_t WriteAt(File* f, uint64_t offset, const Pieces& pieces);	// Overwrites in place up to the end, appends the rest
+	void SyncInPlace(File* f);								// Syncs the blocks WriteAt overwrote in place, if any
+	size_t WriteInFiles(const std::vector<BatchItem*>& items);	// WriteInFile for each item: one batch, commits in journal-sized steps
 	size_t ReadFromFile(File* f, char* buff, size_t len);
+	size_t ReadFromFile(File* f, uint64_t offset, const Pieces& pieces);	// Fills the pieces in order from [offset] on
+	size_t ReadFromFiles(const std::vector<BatchItem*>& items);	// ReadFromFile for each item, as one batch
+	std::vector<std::string_view> ViewFile(File* f) const;	// Zero-copy views of the file data, mapped mode only
 
 	VDisk() = delete;
-	VDisk(const std::string fileName);						// Open existing VDisk
-	VDisk(const std::string fileName, const uint64_t size);	// Create new VDisk
+	VDisk(const std::string fileName, const MountOptions& options = {});						// Open existing VDisk
+	VDisk(const std::string fileName, const uint64_t size, const MountOptions& options = {});	// Create new VDisk
 	~VDisk();
 
 	friend std::ostream& operator<<(std::ostream& s, const VDisk& disk);
 };
 
+/* ---Striping-------------------------------------------------------------- */
+
+/// <summary>
+/// Switches applied when a file is created.
+/// </summary>
+struct CreateOptions
+{
+	unsigned stripes = 0;			// Spread the file over this many VDisks, at most the mounted ones; 0 or 1 keeps it on one
+	uint32_t stripeSize = 64 * BLOCK;	// Bytes stored on one member before the next one takes over, rounded up to blocks
+	size_t writeBuffer = 0;			// Appends are held until this many bytes gather, then written in whole blocks
+};
+
+/// <summary>
+/// Members of a striped file, one per VDisk, all under the file's path. Stripe i of the file is stored on
+/// member i % count, after the member's header block. The first member is the File handed out by VFS.
+/// </summary>
+struct StripeSet
+{
+	std::vector<VDisk*> disks;
+	std::vector<File*> members;
+	uint32_t unit;					// Stripe size, bytes
+
+	inline static const uint32_t HEADER = BLOCK;	// Set id, member index, member count and stripe size, then zeros
+
+	uint64_t Share(uint64_t size, size_t member) const;	// Bytes of the first [size] file bytes stored on [member]
+	uint64_t Size() const;		// File bytes present on all members in the stripe order
+	uint64_t Stored() const;	// File bytes on the members, more than Size() if a write stopped halfway
+	/// Splits [len] bytes at the file [offset] by stripes: [pieces] get the parts of each member, in order, and
+	/// [starts] the member offsets where those parts begin
+	void Split(uint64_t offset, char* buff, size_t len, std::vector<Pieces>& pieces, std::vector<uint64_t>& starts) const;
+};
+
 /* ---VFS------------------------------------------------------------------- */
 
 /// <summary>
@@ -218,33 +452,100 @@ struct IVFS
 	virtual File* Create(const char* name) = 0;
 	virtual size_t Read(File* f, char* buff, size_t len) = 0;
 	virtual size_t Write(File* f, char* buff, size_t len) = 0;
+	virtual size_t ReadAt(File* f, uint64_t offset, char* buff, size_t len) = 0;
+	virtual size_t WriteAt(File* f, uint64_t offset, char* buff, size_t len) = 0;
 	virtual void Close(File* f) = 0;
 };
 
+/// <summary>
+/// Non-blocking counterpart of IVFS: every call returns at once with a future of the result.
+/// The buffers passed must stay valid until the future is ready.
+/// </summary>
+struct IVFSAsync
+{
+	virtual std::future<File*> OpenAsync(const char* name) = 0;
+	virtual std::future<File*> CreateAsync(const char* name) = 0;
+	virtual std::future<size_t> ReadAsync(File* f, char* buff, size_t len) = 0;
+	virtual std::future<size_t> WriteAsync(File* f, char* buff, size_t len) = 0;
+	virtual std::future<size_t> ReadAtAsync(File* f, uint64_t offset, char* buff, size_t len) = 0;
+	virtual std::future<size_t> WriteAtAsync(File* f, uint64_t offset, char* buff, size_t len) = 0;
+	virtual std::future<void> CloseAsync(File* f) = 0;
+};
+
 /// <summary>
 /// Stores multiple VDisks, each of which is associated with a physical file on the underlying file system.
 /// In addition to obligatory IVFS functions, Mount/Unmount were added for managing physical files.
+/// The IVFSAsync calls run the same functions on the VFS-owned IOPool; the calls on one File run in order.
 /// </summary>
-class VFS : IVFS
+class VFS : IVFS, IVFSAsync
 {
 private:
+	/// Full paths to their disk and file, filled by lookups and Create.
+	/// Split by the path hash, so that lookups of different files rarely meet on one lock.
+	struct alignas(64) IndexShard
+	{
+		std::unordered_map<std::string, std::pair<VDisk*, File*>> paths;
+		std::shared_mutex access;
+	};
+	inline static const size_t SHARDS = 64;
+
 	std::vector <VDisk*> disks;
+	std::unique_ptr<PlacementPolicy> placement = std::make_unique<MostFreePlacement>();
+	std::atomic<size_t> readAhead{ ReadAhead::DEFAULT_WINDOW };
+	IOPool pool;
+	std::atomic<unsigned> ioThreads{ IOPool::DEFAULT_THREADS };
+	std::array<IndexShard, SHARDS> index;
+	IndexShard& ShardOf(uint64_t pathHash) { return index[(pathHash >> 32) % SHARDS]; };
 	bool IsValidSize(size_t size);
-	VDisk* GetMostFreeDisk();
 	std::vector<VDisk*>::iterator GetDisk(std::string name);
-
-	std::mutex diskSelection;
-	std::mutex readAccessCheck;
-	std::mutex writeAccessCheck;
+	std::pair<VDisk*, File*> Lookup(const char* name);	// The index first, then only the disks whose filters may hold the path
+
+	std::pair<VDisk*, File*> CreateStriped(const char* name, const CreateOptions& options);
+	std::pair<VDisk*, File*> FindStripes(const char* name, uint64_t hash, VDisk* disk, File* member);	// The first member, with its set
+	size_t Append(File* f, char* buff, size_t len);		// Write without the buffer
+	bool WriteOut(File* f);								// Flush without the sync of the overwrites
+	size_t ReadStriped(File* f, uint64_t offset, char* buff, size_t len);
+	size_t WriteStriped(File* f, uint64_t offset, char* buff, size_t len);
+	template<typename F> auto Async(const void* strand, F task) { pool.Start(ioThreads); return pool.Submit(strand, std::move(task)); };
+	void Parallel(unsigned count, const std::function<void(unsigned)>& task) { pool.Start(ioThreads); pool.Run(count, task); };
 public:
-	bool MountOrCreate(std::string& diskName);
+	void SetCacheBudget(size_t bytes) { BlockCache::Shared().SetBudget(bytes); };	// Shared by all VDisks
+	BlockCache::Stats GetCacheStats() const { return BlockCache::Shared().GetStats(); };
+	void SetReadAhead(size_t bytes) { readAhead = bytes; };	// Largest prefetch window of ReadAt, 0 disables read-ahead
+	ReadAhead::Stats GetReadAheadStats() const { return ReadAhead::Totals(); };
+
+	bool MountOrCreate(std::string& diskName, const MountOptions& options = {});
+	bool CreateAndMount(const std::string& diskName, uint64_t size, const MountOptions& options = {});	// Non-interactive part of MountOrCreate
 	bool Unmount(const std::string& diskName);
+	void SetPlacement(std::unique_ptr<PlacementPolicy> policy);	// Chooses the disks of new files from now on
 
 	File* Open(const char* name) override;
 	File* Create(const char* name) override;
+	File* Create(const char* name, const CreateOptions& options);	// Striped if the options ask for it
 	size_t Read(File* f, char* buff, size_t len) override;
 	size_t Write(File* f, char* buff, size_t len) override;
+	size_t ReadAt(File* f, uint64_t offset, char* buff, size_t len) override;	// Read from [offset] on
+	size_t WriteAt(File* f, uint64_t offset, char* buff, size_t len) override;	// Overwrites in place, extends the file past its end
 	void Close(File* f) override;
+	bool Flush(File* f);								// Writes out the buffered appends, syncs the overwrites; false if not all appends fit
+	bool Delete(const char* name);						// Deletes a closed file, its space is reused
+
+	std::vector<File*> CreateBatch(const std::vector<std::string>& names, const CreateOptions& options = {});	// Create for each name
+	size_t WriteBatch(std::vector<BatchItem>& items);	// Write for each item; returns the bytes written in total
+	size_t ReadBatch(std::vector<BatchItem>& items);	// Read for each item; returns the bytes read in total
+
+	std::vector<std::string_view> ReadView(File* f);	// Zero-copy Read for mapped VDisks: one view per contiguous run of blocks
+
+	std::future<File*> OpenAsync(const char* name) override;
+	std::future<File*> CreateAsync(const char* name) override;
+	std::future<File*> CreateAsync(const char* name, const CreateOptions& options);
+	std::future<size_t> ReadAsync(File* f, char* buff, size_t len) override;
+	std::future<size_t> WriteAsync(File* f, char* buff, size_t len) override;
+	std::future<size_t> ReadAtAsync(File* f, uint64_t offset, char* buff, size_t len) override;
+	std::future<size_t> WriteAtAsync(File* f, uint64_t offset, char* buff, size_t len) override;
+	std::future<void> CloseAsync(File* f) override;
+	std::future<bool> FlushAsync(File* f);
+	void SetIOThreads(unsigned threads);				// Waits for the async calls in progress; the next one starts the workers
 
 	void PrintAll();
 
@@ -255,15 +556,16 @@ public:
 /* ---Misc------------------------------------------------------------------ */
 
 char* OpenAndReadInfo(std::string filename, uint32_t position, const uint32_t length);
+void RunParallel(unsigned workers, const std::function<void(unsigned)>& task);	// task(0..workers-1), one thread each; rethrows
 
 template<typename T> char* IntToChar(const T& data);
+void PutInt(char* bytes, uint64_t value, size_t length);
 char* StrToChar(const std::string data);
 uint32_t CharToInt32(const char* bytes);
 uint64_t CharToInt64(const char* bytes);
-char* DirToChar(uint32_t nodecode, std::string name, uint32_t firstchild);
+char* DirToChar(uint32_t nodecode, std::string name, uint32_t dircode);
 
 uint64_t GetDiskSize(std::string filename);	
 
-void TreeToPlain(std::vector<char*>& info, Vertice<File*>& tree, uint32_t& nodecode);
 
 std::string Aligned(size_t number, short length);
\ No newline at end of file
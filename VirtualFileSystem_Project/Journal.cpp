@@ -0,0 +1,400 @@
+#include "Journal.h"
+#include "BlockCache.h"
+#include "IVFS.h"
+
+#include <algorithm>
+#include <iostream>
+
+/* ---Journal--------------------------------------------------------------- */
+
+namespace
+{
+	const uint32_t MAGIC = 0x56'46'53'4A;	// "VFSJ"
+	const size_t HEADER = 2 * ADDR;			// Magic, epoch
+	const size_t FRAME = 3 * ADDR;			// Epoch, payload length, checksum
+	const size_t RECORD = 3 * ADDR;			// Position (2 ADDR), data length
+	const uint32_t REVOKE = 0x8000'0000;	// Length flag of a revoke record, which carries no data
+
+	/// FNV-1a of the payload, seeded with the epoch
+	uint32_t Checksum(const char* data, size_t length, uint32_t epoch)
+	{
+		uint32_t hash = 2166136261u ^ epoch;
+		for (size_t i = 0; i != length; ++i)
+		{
+			hash ^= uint8_t(data[i]);
+			hash *= 16777619u;
+		}
+		return hash;
+	}
+	/// Bytes of data following the record header
+	size_t DataLength(const char* record)
+	{
+		uint32_t length = CharToInt32(record + 2 * ADDR);
+		return length & REVOKE ? 0 : length;
+	}
+}
+
+Journal::Transaction::Transaction(Journal& journal) :
+	journal(journal),
+	lastRecord(0)
+{
+	if (current) throw std::logic_error("Journal transactions can't be nested");
+	current = this;
+}
+Journal::Transaction::~Transaction()
+{
+	if (current == this) current = nullptr;
+}
+/// <summary>
+/// Hands the collected records over to the journal. The thread's later writes are not journaled.
+/// </summary>
+/// <returns>The ticket to Wait for; 0 if there was nothing to commit</returns>
+uint64_t Journal::Transaction::Submit()
+{
+	if (current == this) current = nullptr;
+	return journal.Enqueue(std::move(records));
+}
+
+Journal::Journal(BinDisk& disk, size_t start, size_t capacity, Apply apply) :
+	disk(disk),
+	start(start),
+	capacity(capacity),
+	apply(std::move(apply)),
+	epoch(0),
+	tail(HEADER),
+	submitted(0),
+	committed(0),
+	busy(false),
+	stop(false),
+	stats{ 0, 0, 0, 0 }
+{
+}
+Journal::~Journal()
+{
+	Stop();
+}
+
+/// <summary>
+/// Appends the write to the calling thread's transaction. A write that continues the previous one
+/// extends its record, so sequential MetaPuts (title block slots, counters) cost one record header.
+/// </summary>
+/// <returns>False if the thread has no transaction on this journal: the caller applies the write itself</returns>
+bool Journal::Log(size_t position, const char* data, size_t length)
+{
+	Transaction* t = current;
+	if (!t || &t->journal != this) return false;
+
+	auto& records = t->records;
+	if (!records.empty())
+	{
+		char* last = records.data() + t->lastRecord;
+		uint32_t lastLength = CharToInt32(last + 2 * ADDR);
+		if (!(lastLength & REVOKE) && CharToInt64(last) + lastLength == position)
+		{
+			PutInt(last + 2 * ADDR, lastLength + length, ADDR);
+			records.insert(records.end(), data, data + length);
+			return true;
+		}
+	}
+	t->lastRecord = records.size();
+	records.resize(records.size() + RECORD);
+	PutInt(records.data() + t->lastRecord, position, 2 * ADDR);
+	PutInt(records.data() + t->lastRecord + 2 * ADDR, length, ADDR);
+	records.insert(records.end(), data, data + length);
+	return true;
+}
+/// <summary>
+/// Adds a revoke record to the calling thread's transaction: after a crash, the records of [position, position + length)
+/// logged before it are not replayed. Metadata blocks that are freed get revoked, since once reused for data they are
+/// written in place, and stale records would land on top of the new data.
+/// </summary>
+void Journal::Revoke(size_t position, size_t length)
+{
+	Transaction* t = current;
+	if (!t || &t->journal != this) return;
+
+	auto& records = t->records;
+	t->lastRecord = records.size();
+	records.resize(records.size() + RECORD);
+	PutInt(records.data() + t->lastRecord, position, 2 * ADDR);
+	PutInt(records.data() + t->lastRecord + 2 * ADDR, REVOKE | length, ADDR);
+}
+/// <summary>
+/// Metadata written in the current transaction is not applied yet, so reads of the same thread see it through here.
+/// </summary>
+void Journal::Overlay(size_t position, char* data, size_t length) const
+{
+	const Transaction* t = current;
+	if (!t || &t->journal != this) return;
+
+	const auto& records = t->records;
+	for (size_t i = 0; i != records.size(); )
+	{
+		size_t pos = CharToInt64(&records[i]), len = DataLength(&records[i]);
+		const char* bytes = records.data() + i + RECORD;
+		size_t from = std::max(pos, position), to = std::min(pos + len, position + length);
+		if (from < to) std::copy(bytes + (from - pos), bytes + (to - pos), data + (from - position));
+		i += RECORD + len;
+	}
+}
+
+uint64_t Journal::Enqueue(std::vector<char>&& records)
+{
+	if (records.empty()) return 0;
+	std::lock_guard<std::mutex> guard(lock);
+	queue.push_back(std::move(records));
+	return ++submitted;
+}
+/// <summary>
+/// Group commit: the first waiting thread becomes the leader and writes everything queued so far,
+/// the others wait for it. Transactions queued during the write go with the next group.
+/// </summary>
+void Journal::Wait(uint64_t ticket)
+{
+	std::unique_lock<std::mutex> guard(lock);
+	while (committed < ticket)
+	{
+		if (busy)
+		{
+			changed.wait(guard);
+			continue;
+		}
+		busy = true;
+		std::vector<std::vector<char>> group;
+		group.swap(queue);
+		uint64_t last = submitted;
+		guard.unlock();
+		try
+		{
+			WriteGroup(group);
+		}
+		catch (...)
+		{
+			guard.lock();
+			busy = false;
+			changed.notify_all();
+			throw;
+		}
+		guard.lock();
+		committed = last;
+		busy = false;
+		changed.notify_all();
+	}
+}
+/// <summary>
+/// Frames the transactions and writes them in as few writes as the free space allows.
+/// A transaction that can't fit even into an empty region is applied directly and checkpointed at once.
+/// </summary>
+void Journal::WriteGroup(std::vector<std::vector<char>>& group)
+{
+	std::vector<char> frames;
+	for (auto& records : group)
+	{
+		size_t framed = FRAME + records.size();
+		if (HEADER + framed > capacity)
+		{
+			WriteFrames(frames);
+			frames.clear();
+			for (size_t i = 0, len; i != records.size(); i += RECORD + len)
+				if ((len = DataLength(&records[i]))) apply(CharToInt64(&records[i]), &records[i + RECORD], len);
+			Reset();
+			std::lock_guard<std::mutex> guard(lock);
+			++stats.transactions;
+			continue;
+		}
+		if (tail + frames.size() + framed > capacity)
+		{
+			WriteFrames(frames);
+			frames.clear();
+			Reset();
+		}
+		size_t at = frames.size();
+		frames.resize(at + FRAME);
+		PutInt(&frames[at], epoch, ADDR);
+		PutInt(&frames[at + ADDR], records.size(), ADDR);
+		PutInt(&frames[at + 2 * ADDR], Checksum(records.data(), records.size(), epoch), ADDR);
+		frames.insert(frames.end(), records.begin(), records.end());
+	}
+	WriteFrames(frames);
+}
+void Journal::WriteFrames(const std::vector<char>& frames)
+{
+	if (frames.empty()) return;
+	if (!disk.SetBytes(start + tail, frames.data(), frames.size())) throw std::runtime_error("Failed to write the journal");
+	disk.Flush();
+	size_t count = ApplyFrames(frames.data(), frames.size());
+
+	std::lock_guard<std::mutex> guard(lock);
+	tail += frames.size();
+	stats.transactions += count;
+	stats.bytes += frames.size();
+	++stats.groups;
+}
+size_t Journal::ApplyFrames(const char* frames, size_t length)
+{
+	return Walk(frames, length, [this](const char* record)
+	{
+		if (size_t len = DataLength(record)) apply(CharToInt64(record), record + RECORD, len);
+	});
+}
+/// <summary>
+/// Calls visit for every record of the valid transactions in the order of writing.
+/// </summary>
+/// <returns>The number of valid transactions</returns>
+size_t Journal::Walk(const char* frames, size_t length, const std::function<void(const char* record)>& visit) const
+{
+	size_t count = 0;
+	for (size_t pos = 0; pos + FRAME <= length; ++count)
+	{
+		const char* frame = frames + pos;
+		size_t size = CharToInt32(frame + ADDR);
+		if (CharToInt32(frame) != epoch || size > length - pos - FRAME) break;
+		const char* records = frame + FRAME;
+		if (Checksum(records, size, epoch) != CharToInt32(frame + 2 * ADDR)) break;
+		for (size_t i = 0; i + RECORD <= size; i += RECORD + DataLength(records + i)) visit(records + i);
+		pos += FRAME + size;
+	}
+	return count;
+}
+/// <summary>
+/// Writes the applied metadata back to its home location, then starts a new epoch, which invalidates all records.
+/// </summary>
+void Journal::Reset()
+{
+	BlockCache::Shared().Flush(disk);
+	disk.Flush();
+
+	char header[HEADER];
+	PutInt(header, MAGIC, ADDR);
+	PutInt(header + ADDR, epoch + 1, ADDR);
+	if (!disk.SetBytes(start, header, HEADER)) throw std::runtime_error("Failed to write the journal");
+	disk.Flush();
+
+	std::lock_guard<std::mutex> guard(lock);
+	++epoch;
+	tail = HEADER;
+	++stats.checkpoints;
+}
+void Journal::Checkpoint()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	changed.wait(guard, [this] { return !busy; });
+	busy = true;
+	guard.unlock();
+	try
+	{
+		Reset();
+	}
+	catch (...)
+	{
+		guard.lock();
+		busy = false;
+		changed.notify_all();
+		throw;
+	}
+	guard.lock();
+	busy = false;
+	changed.notify_all();
+}
+/// <summary>
+/// The background checkpointer: wakes up when the region is half full.
+/// </summary>
+void Journal::Run()
+{
+	std::unique_lock<std::mutex> guard(lock);
+	while (true)
+	{
+		changed.wait(guard, [this] { return stop || (!busy && tail * 2 >= capacity); });
+		if (stop) return;
+		busy = true;
+		guard.unlock();
+		try
+		{
+			Reset();
+		}
+		catch (std::exception& e)
+		{
+			std::cout << "Journal checkpoint failed: " << e.what() << std::endl;
+		}
+		guard.lock();
+		busy = false;
+		changed.notify_all();
+	}
+}
+
+void Journal::Format()
+{
+	epoch = 0;
+	Reset();
+}
+/// <summary>
+/// Applies every valid transaction of the current epoch in the order of writing and checkpoints them.
+/// A torn or partly written transaction ends the replay. The bytes of a record revoked by a later record are skipped.
+/// </summary>
+size_t Journal::Replay()
+{
+	std::vector<char> region(capacity);
+	if (!disk.GetBytes(start, region.data(), capacity)) throw std::runtime_error("Failed to read the journal");
+	if (CharToInt32(region.data()) != MAGIC) throw std::runtime_error("No journal found, the VDisk format is not supported");
+	epoch = CharToInt32(region.data() + ADDR);
+	tail = HEADER;
+
+	struct Revoked
+	{
+		size_t from, to;
+		size_t index;		// Of the revoke record, records before it are cut
+	};
+	std::vector<Revoked> revoked;
+	size_t index = 0;
+	Walk(region.data() + HEADER, capacity - HEADER, [&](const char* record)
+	{
+		uint32_t length = CharToInt32(record + 2 * ADDR);
+		if (length & REVOKE) revoked.push_back({ CharToInt64(record), CharToInt64(record) + (length & ~REVOKE), index });
+		++index;
+	});
+
+	size_t later = 0;		// First revoke past the current record
+	index = 0;
+	size_t count = Walk(region.data() + HEADER, capacity - HEADER, [&](const char* record)
+	{
+		while (later != revoked.size() && revoked[later].index <= index) ++later;
+		++index;
+		size_t pos = CharToInt64(record), len = DataLength(record);
+		if (!len) return;
+
+		std::vector<std::pair<size_t, size_t>> cuts;
+		for (size_t r = later; r != revoked.size(); ++r)
+			if (revoked[r].from < pos + len && pos < revoked[r].to)
+				cuts.emplace_back(std::max(revoked[r].from, pos), std::min(revoked[r].to, pos + len));
+		std::sort(cuts.begin(), cuts.end());
+		size_t at = pos;
+		for (auto [from, to] : cuts)
+		{
+			if (at < from) apply(at, record + RECORD + (at - pos), from - at);
+			at = std::max(at, to);
+		}
+		if (at < pos + len) apply(at, record + RECORD + (at - pos), pos + len - at);
+	});
+	Reset();
+	return count;
+}
+void Journal::Start()
+{
+	if (!checkpointer.joinable()) checkpointer = std::thread(&Journal::Run, this);
+}
+void Journal::Stop()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stop = true;
+	}
+	changed.notify_all();
+	if (checkpointer.joinable()) checkpointer.join();
+	stop = false;
+}
+
+Journal::Stats Journal::GetStats() const
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return stats;
+}
@@ -0,0 +1,102 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class BinDisk;
+
+/* ---Journal--------------------------------------------------------------- */
+
+/// <summary>
+/// Write-ahead log of the metadata changes of one VDisk, stored in the journal region of the VDisk file.
+/// A thread collects its changes in a Transaction. Submitted transactions are written to the region together
+/// with all the others waiting at that moment (group commit): one sequential write and one sync per group.
+/// Only then they are applied to the metadata, which reaches its home location later, on a checkpoint.
+/// A background thread checkpoints once the region is half full. Replay applies what is left after a crash.
+/// <para> For the region format, see the README.md </para>
+/// </summary>
+class Journal
+{
+public:
+	using Apply = std::function<void(size_t position, const char* data, size_t length)>;
+
+	struct Stats
+	{
+		uint64_t transactions;
+		uint64_t groups;		// Journal writes, each one holds one or more transactions
+		uint64_t bytes;
+		uint64_t checkpoints;
+	};
+
+	/// <summary>
+	/// Collects the metadata writes of the calling thread until Submit. Not submitted changes are discarded.
+	/// </summary>
+	class Transaction
+	{
+	private:
+		Journal& journal;
+		std::vector<char> records;
+		size_t lastRecord;			// Offset of the last record, a contiguous write is merged into it
+		friend class Journal;
+	public:
+		uint64_t Submit();			// Queues the changes; the commit order is the order of Submit calls
+		size_t Size() const { return records.size(); };	// Bytes of records collected so far
+		void Commit() { journal.Wait(Submit()); };
+
+		explicit Transaction(Journal& journal);
+		Transaction(const Transaction&) = delete;
+		Transaction& operator=(const Transaction&) = delete;
+		~Transaction();
+	};
+
+private:
+	inline static thread_local Transaction* current = nullptr;
+
+	BinDisk& disk;
+	const size_t start;				// Absolute position of the region
+	const size_t capacity;			// Region length, bytes
+	Apply apply;
+
+	uint32_t epoch;					// Records of other epochs are stale
+	size_t tail;					// Bytes used in the region, including the header
+
+	std::vector<std::vector<char>> queue;	// Submitted, not yet written transactions
+	uint64_t submitted, committed;
+	bool busy;						// A group write or a checkpoint is in progress
+	bool stop;
+	mutable std::mutex lock;
+	std::condition_variable changed;
+	std::thread checkpointer;
+	Stats stats;
+
+	uint64_t Enqueue(std::vector<char>&& records);
+	void WriteGroup(std::vector<std::vector<char>>& group);
+	void WriteFrames(const std::vector<char>& frames);	// Writes, syncs and applies framed transactions
+	size_t ApplyFrames(const char* frames, size_t length);	// Applies the valid transactions, returns how many
+	size_t Walk(const char* frames, size_t length, const std::function<void(const char* record)>& visit) const;
+	void Reset();										// Writes back the applied metadata and empties the region
+	void Run();
+
+public:
+	bool Log(size_t position, const char* data, size_t length);	// Adds the write to the thread's transaction, if it has one
+	void Revoke(size_t position, size_t length);					// Stops replaying earlier writes there, see the README
+	void Overlay(size_t position, char* data, size_t length) const;	// Lays the thread's pending writes over the read data
+
+	void Wait(uint64_t ticket);		// Returns when the transaction is durable and applied
+	void Checkpoint();
+
+	void Format();					// Initializes an empty region on a new VDisk
+	size_t Replay();				// Applies the transactions left in the region; returns how many
+	void Start();					// Starts the background checkpointer
+	void Stop();
+
+	Stats GetStats() const;
+
+	Journal(BinDisk& disk, size_t start, size_t capacity, Apply apply);
+	Journal(const Journal&) = delete;
+	Journal& operator=(const Journal&) = delete;
+	~Journal();
+};
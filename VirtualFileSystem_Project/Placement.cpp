@@ -0,0 +1,119 @@
+#include "Placement.h"
+#include "IVFS.h"
+
+#include <algorithm>
+
+/* ---PlacementPolicy------------------------------------------------------- */
+
+namespace
+{
+	bool HasSpace(const VDisk* disk)
+	{
+		return disk->GetNodesLeft() && disk->GetBlocksLeft();
+	}
+	/// Spreads the FNV hash over all 64 bits, its high bits are weak
+	uint64_t Mix(uint64_t hash)
+	{
+		hash ^= hash >> 33;
+		hash *= 0xFF51AFD7ED558CCDull;
+		hash ^= hash >> 33;
+		hash *= 0xC4CEB9FE1A85EC53ull;
+		hash ^= hash >> 33;
+		return hash;
+	}
+}
+
+/* ---MostFreePlacement----------------------------------------------------- */
+
+void MostFreePlacement::Update(const std::vector<VDisk*>& disks)
+{
+	this->disks = disks;
+	best = nullptr;
+}
+VDisk* MostFreePlacement::Place(std::string_view)
+{
+	VDisk* disk = best.load(std::memory_order_acquire);
+	if (!disk || !HasSpace(disk) || placed.fetch_add(1, std::memory_order_relaxed) % REFRESH == 0) disk = Rescan();
+	return disk;
+}
+/// <summary>
+/// One thread scans, the others keep using the cached disk meanwhile if it still has space.
+/// </summary>
+VDisk* MostFreePlacement::Rescan()
+{
+	std::unique_lock<std::mutex> lock(rescan, std::try_to_lock);
+	if (!lock)
+	{
+		VDisk* disk = best.load(std::memory_order_acquire);
+		if (disk && HasSpace(disk)) return disk;
+		lock.lock();
+	}
+	VDisk* chosen = nullptr;
+	uint32_t most = 0;
+	for (VDisk* disk : disks)
+	{
+		uint32_t blocks = disk->GetBlocksLeft();
+		if (disk->GetNodesLeft() && blocks > most)
+		{
+			most = blocks;
+			chosen = disk;
+		}
+	}
+	best.store(chosen, std::memory_order_release);
+	return chosen;
+}
+
+/* ---RoundRobinPlacement--------------------------------------------------- */
+
+void RoundRobinPlacement::Update(const std::vector<VDisk*>& disks)
+{
+	this->disks = disks;
+}
+VDisk* RoundRobinPlacement::Place(std::string_view)
+{
+	for (size_t i = 0; i != disks.size(); ++i)
+	{
+		VDisk* disk = disks[next.fetch_add(1, std::memory_order_relaxed) % disks.size()];
+		if (HasSpace(disk)) return disk;
+	}
+	return nullptr;
+}
+
+/* ---HashPlacement--------------------------------------------------------- */
+
+void HashPlacement::Update(const std::vector<VDisk*>& disks)
+{
+	ring.clear();
+	for (VDisk* disk : disks)
+	{
+		uint64_t hash = BloomFilter::Hash(disk->GetName());	// Points follow the name, not the mount order
+		for (unsigned i = 0; i != POINTS; ++i) ring.emplace_back(Mix(hash + i), disk);
+	}
+	std::sort(ring.begin(), ring.end());
+}
+size_t HashPlacement::Point(std::string_view path) const
+{
+	if (key == Key::Parent)
+	{
+		size_t pos = path.find_last_of(Vertice<File*>::DELIMITER);
+		path = path.substr(0, pos == std::string_view::npos ? 0 : pos);
+	}
+	uint64_t hash = Mix(BloomFilter::Hash(path));
+	size_t point = std::lower_bound(ring.begin(), ring.end(), std::make_pair(hash, (VDisk*)nullptr)) - ring.begin();
+	return point == ring.size() ? 0 : point;
+}
+VDisk* HashPlacement::Home(std::string_view path)
+{
+	return ring.empty() ? nullptr : ring[Point(path)].second;
+}
+VDisk* HashPlacement::Place(std::string_view path)
+{
+	if (ring.empty()) return nullptr;
+	size_t point = Point(path);
+	for (size_t i = 0; i != ring.size(); ++i)	// The next points mostly belong to other disks
+	{
+		VDisk* disk = ring[(point + i) % ring.size()].second;
+		if (HasSpace(disk)) return disk;
+	}
+	return nullptr;
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+class VDisk;
+
+/* ---PlacementPolicy------------------------------------------------------- */
+
+/// <summary>
+/// Chooses the VDisk of every new file. VFS calls Update whenever the mounted disks change, Place from
+/// concurrent Create calls, and Home from lookups. Mounting and unmounting don't run along with other calls.
+/// </summary>
+class PlacementPolicy
+{
+public:
+	virtual void Update(const std::vector<VDisk*>& disks) = 0;		// The disks mounted from now on
+	virtual VDisk* Place(std::string_view path) = 0;				// nullptr if no disk has space left
+	virtual VDisk* Home(std::string_view /*path*/) { return nullptr; }	// Where a path would be placed; lookups check it first
+
+	virtual ~PlacementPolicy() = default;
+};
+
+/// <summary>
+/// The disk with the most free blocks. The choice is cached and rescanned every REFRESH placements,
+/// or at once when the chosen disk fills up.
+/// </summary>
+class MostFreePlacement : public PlacementPolicy
+{
+private:
+	std::vector<VDisk*> disks;
+	std::atomic<VDisk*> best{ nullptr };
+	std::atomic<uint32_t> placed{ 0 };
+	std::mutex rescan;
+
+	VDisk* Rescan();
+public:
+	inline static const uint32_t REFRESH = 64;
+
+	void Update(const std::vector<VDisk*>& disks) override;
+	VDisk* Place(std::string_view path) override;
+};
+
+/// <summary>
+/// The disks in turn, skipping the full ones, so parallel writers are spread over all backing files.
+/// </summary>
+class RoundRobinPlacement : public PlacementPolicy
+{
+private:
+	std::vector<VDisk*> disks;
+	std::atomic<size_t> next{ 0 };
+public:
+	void Update(const std::vector<VDisk*>& disks) override;
+	VDisk* Place(std::string_view path) override;
+};
+
+/// <summary>
+/// Consistent hashing of the path or of its parent directory onto a ring of POINTS points per disk.
+/// A path always maps to the same disk while the disks don't change, and mounting or unmounting one
+/// moves only its share of the paths. A full disk passes its paths on to the next disk of the ring.
+/// </summary>
+class HashPlacement : public PlacementPolicy
+{
+public:
+	enum class Key
+	{
+		Path,		// Files are spread evenly
+		Parent		// Files of one directory stay together
+	};
+	inline static const unsigned POINTS = 64;
+
+private:
+	const Key key;
+	std::vector<std::pair<uint64_t, VDisk*>> ring;	// Sorted by the point
+
+	size_t Point(std::string_view path) const;		// Ring position of the path's key
+public:
+	void Update(const std::vector<VDisk*>& disks) override;
+	VDisk* Place(std::string_view path) override;
+	VDisk* Home(std::string_view path) override;
+
+	explicit HashPlacement(Key key = Key::Parent) : key(key) {};
+};
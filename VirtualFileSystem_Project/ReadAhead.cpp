@@ -0,0 +1,134 @@
+#include "ReadAhead.h"
+#include "IOPool.h"
+
+#include <algorithm>
+#include <cstring>
+
+/* ---ReadAhead------------------------------------------------------------- */
+
+ReadAhead::~ReadAhead()
+{
+	Settle();
+}
+
+/// <summary>
+/// Reads [len] bytes at [offset], from the prefetched windows as far as they hold them and from [source]
+/// for the rest. A sequential read starts the prefetch of the next window if none is running.
+/// Reads from [source] are not serialized: they are made without holding the read-ahead.
+/// </summary>
+/// <returns>Number of bytes read, less than [len] if the file ends first</returns>
+size_t ReadAhead::Read(const Source& source, uint64_t offset, char* buff, size_t len, size_t limit)
+{
+	len = size_t(std::min<uint64_t>(source.size - std::min(source.size, offset), len));
+	if (!len) return 0;
+
+	std::unique_lock<std::mutex> guard(lock);
+	const bool sequential = offset == next;
+	next = offset + len;
+	const bool held = (offset >= ready.start && offset < ready.start + ready.length)
+		|| (pending.valid() && !stale && offset >= ahead.start && offset < ahead.start + ahead.data.size());
+	if (!limit || (!sequential && !held))
+	{
+		streak = 0;
+		window = 0;
+		stale = true;
+		guard.unlock();
+		if (limit) ++misses;
+		return source.read(offset, buff, len);
+	}
+
+	size_t got = Take(offset, buff, len);
+	used += got;
+	if (got == len) ++hits;
+	else ++misses;
+	if (sequential && ++streak >= 2) Issue(source, len, limit);
+	guard.unlock();
+	if (got != len) got += source.read(offset + got, buff + got, len - got);
+	return got;
+}
+/// <returns>Number of bytes copied from the start of the request</returns>
+size_t ReadAhead::Take(uint64_t offset, char* buff, size_t len)
+{
+	size_t got = 0;
+	while (got != len)
+	{
+		const uint64_t at = offset + got;
+		if (at >= ready.start && at < ready.start + ready.length)
+		{
+			size_t count = size_t(std::min<uint64_t>(len - got, ready.start + ready.length - at));
+			std::memcpy(buff + got, ready.data.data() + (at - ready.start), count);
+			got += count;
+		}
+		else if (pending.valid() && !stale && at >= ahead.start && at < ahead.start + ahead.data.size())
+		{
+			ahead.length = Finish();
+			std::swap(ready, ahead);
+		}
+		else break;
+	}
+	return got;
+}
+/// <summary>
+/// Prefetches the window that follows the ready one. The first window is at least MIN_WINDOW and twice the
+/// read, every next one doubles up to [limit].
+/// </summary>
+void ReadAhead::Issue(const Source& source, size_t len, size_t limit)
+{
+	if (pending.valid() && !stale) return;
+	uint64_t start = next;
+	if (next >= ready.start && next <= ready.start + ready.length) start = ready.start + ready.length;
+	if (start >= source.size) return;
+
+	window = std::min(window ? window * 2 : std::max(MIN_WINDOW, 2 * len), limit);
+	size_t length = size_t(std::min<uint64_t>(window, source.size - start));
+	uint64_t run = source.run(start);
+	if (run < length && run >= length / 2) length = size_t(run);	// One transfer, the next window starts on a new run
+
+	Settle();
+	ahead.data.resize(length);
+	ahead.start = start;
+	ahead.length = 0;
+	stale = false;
+	job = std::make_shared<Prefetch>();
+	job->read = source.read;
+	job->start = start;
+	job->data = ahead.data.data();
+	job->length = length;
+	pending = source.pool->Submit(nullptr, [job = job]
+	{
+		if (job->Take()) job->got = job->read(job->start, job->data, job->length);
+	});
+	++windows;
+	prefetched += length;
+}
+size_t ReadAhead::Finish()
+{
+	if (job->Take()) job->got = job->read(job->start, job->data, job->length);
+	else pending.get();
+	size_t got = job->got;
+	job.reset();
+	pending = std::future<void>();
+	return got;
+}
+void ReadAhead::Settle()
+{
+	if (job && !job->Take() && pending.valid()) pending.wait();
+	job.reset();
+	pending = std::future<void>();
+}
+void ReadAhead::Reset()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	Settle();
+	ready = Window();
+	ahead = Window();
+	stale = false;
+	next = 0;
+	streak = 0;
+	window = 0;
+}
+
+ReadAhead::Stats ReadAhead::Totals()
+{
+	return { hits.load(), misses.load(), windows.load(), prefetched.load(), used.load() };
+}
@@ -0,0 +1,97 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class IOPool;
+
+/* ---ReadAhead------------------------------------------------------------- */
+
+/// <summary>
+/// Read-ahead of one file, shared by its readers. Once reads keep starting where the previous one ended,
+/// the next window of the file is read in the background while the caller consumes the current one.
+/// The window starts at MIN_WINDOW, doubles with every prefetch up to the limit given by the caller, and
+/// ends at a break in the data blocks when that's past its middle, so a prefetch is one transfer.
+/// Prefetches run on the IOPool of the source.
+/// A read elsewhere resets the window and stops prefetching.
+/// The file must not change while the read-ahead holds data: writers call Reset after taking the file.
+/// </summary>
+class ReadAhead
+{
+public:
+	struct Stats
+	{
+		uint64_t hits;			// Reads served from the prefetched data entirely
+		uint64_t misses;		// Reads that went to VDisk, at least partly
+		uint64_t windows;		// Prefetches issued
+		uint64_t prefetched;	// Bytes prefetched
+		uint64_t used;			// Prefetched bytes handed out to readers
+	};
+	/// <summary>
+	/// Where the data comes from: the file size, a read from an offset, the number of bytes stored
+	/// contiguously from an offset on, and the running pool the prefetches are queued on.
+	/// </summary>
+	struct Source
+	{
+		uint64_t size;
+		std::function<size_t(uint64_t offset, char* buff, size_t len)> read;
+		std::function<uint64_t(uint64_t offset)> run;
+		IOPool* pool;
+	};
+	inline static const size_t MIN_WINDOW = 64 * 1024;		// Bytes
+	inline static const size_t DEFAULT_WINDOW = 1024 * 1024;	// Largest window unless VFS::SetReadAhead changes it, bytes
+
+private:
+	struct Window
+	{
+		std::vector<char> data;
+		uint64_t start = 0;
+		size_t length = 0;		// Bytes of data read, known once the prefetch is done
+	};
+	/// <summary>
+	/// A prefetch queued on the pool. Whoever takes it first runs it: a worker, or the reader that needs the data
+	/// before any worker got to it. So a reader running on the pool never waits for a task queued behind it.
+	/// </summary>
+	struct Prefetch
+	{
+		std::atomic<bool> taken{ false };
+		std::function<size_t(uint64_t offset, char* buff, size_t len)> read;
+		uint64_t start = 0;
+		char* data = nullptr;
+		size_t length = 0;
+		size_t got = 0;			// Set by whoever ran it
+
+		bool Take() { return !taken.exchange(true); };
+	};
+
+	Window ready;					// Prefetched and done
+	Window ahead;					// Being prefetched while pending is valid
+	std::shared_ptr<Prefetch> job;	// The prefetch of [ahead]
+	std::future<void> pending;
+	bool stale = false;				// The pending prefetch is not wanted anymore
+	uint64_t next = 0;				// Where a sequential read starts
+	unsigned streak = 0;			// Sequential reads in a row
+	size_t window = 0;				// Size of the last prefetch, 0 before the first one
+	std::mutex lock;
+
+	inline static std::atomic<uint64_t> hits{ 0 }, misses{ 0 }, windows{ 0 }, prefetched{ 0 }, used{ 0 };
+
+	size_t Take(uint64_t offset, char* buff, size_t len);		// Copies from the ready window, waits for the pending one
+	void Issue(const Source& source, size_t len, size_t limit);	// Queues the next prefetch unless one is pending
+	size_t Finish();											// Runs or waits for the pending prefetch; its bytes read
+	void Settle();												// Cancels the pending prefetch or waits for it
+public:
+	size_t Read(const Source& source, uint64_t offset, char* buff, size_t len, size_t limit);	// [limit] == 0 disables
+	void Reset();					// Drops the windows, waits for a prefetch still running
+
+	static Stats Totals();			// Summed over all files
+
+	ReadAhead() = default;
+	ReadAhead(const ReadAhead&) = delete;
+	ReadAhead& operator=(const ReadAhead&) = delete;
+	~ReadAhead();
+};
@@ -1,113 +1,342 @@
 #pragma once
-#include <map>
 #include <string>
+#include <string_view>
 #include <sstream>
-#include <memory>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <shared_mutex>
+#include <mutex>
 #include "IVFS.h"
 
+/// <summary>
+/// A directory of the file tree. Children are kept in a flat vector; directories with many entries also get
+/// an open-addressing index over it (linear probing, hashes cached in the entries).
+/// All lookups take string_views, so resolving a path allocates nothing.
+/// Every directory has its own lock: lookups share it level by level, changes of a directory lock only that directory.
+/// Directories are never removed while the tree is in use, so a child pointer stays valid after the lock is released.
+/// </summary>
 template <typename T>
 class Vertice
 {
 private:
-	std::map<std::string, std::pair<std::unique_ptr<T>, Vertice*>> _children;
+	struct Entry
+	{
+		std::string name;
+		size_t hash;
+		T data;					// Empty for a directory
+		Vertice* dir;			// nullptr for a leaf
+	};
+	inline static const uint32_t NONE = UINT32_MAX;
+	inline static const size_t INDEXED = 16;	// Smaller directories are scanned linearly
+
+	std::vector<Entry> _children;
+	std::vector<uint32_t> _index;	// Entry number + 1 per slot, 0 for an empty slot; a power of two in size
+	uint32_t _code = 0;		// Directory code, stored as NC by the children's nodes
+	mutable std::shared_mutex _access;	// Guards _children and _index of this directory
+
+	static size_t Hash(std::string_view name) { return std::hash<std::string_view>{}(name); };
+	uint32_t Find(std::string_view name, size_t hash) const;
+	uint32_t Insert(std::string_view name, size_t hash);
+	void Erase(uint32_t entry);
+	size_t SlotOf(uint32_t entry) const;
+	void Reindex(size_t capacity);
 public:
 	inline static char DELIMITER = '\\';
 
 	void Add(std::string_view path, const T& data);	// Creates all the vertices within path, with data generated on the flow
+	template <typename MakeCode> Vertice* AddDir(std::string_view name, MakeCode&& makeCode);	// Finds or creates a child directory
+	template <typename Make> bool AddLeaf(std::string_view name, Make&& make);	// Adds a leaf unless the name is taken
+	void Remove(std::string_view name);				// Forgets a leaf child; the data itself is not deleted
 	void Destroy();									// Recursively deletes all the children tree
-	void BindNewTreeToChild(const std::string& name, Vertice* nodePtr, bool deleteData = false);
+	void BindNewTreeToChild(std::string_view name, Vertice* nodePtr, bool deleteData = false);
 
-	T GetData(std::string_view path);
-	uint32_t Count();
+	T GetData(std::string_view path) const;
+	T Seek(std::string_view path) const;			// GetData without throwing: empty data if there is no such leaf
+	Vertice* GetDir(std::string_view name) const;	// Child directory, nullptr if there is none
+	bool Contains(std::string_view name) const;
+	uint32_t GetCode() const { return _code; };
+	void SetCode(uint32_t code) { _code = code; };
+	uint32_t Count() const;
 
-	std::string PrintVerticeTree(bool unpack = false, uint32_t count = 0);
-	friend void TreeToPlain(std::vector<char*>& info, Vertice<T>& tree, uint32_t& nodecode);
+	std::string PrintVerticeTree(bool unpack = false, uint32_t count = 0) const;
 };
 
-template <typename T> void Vertice<T>::Add(std::string_view path, const T& data)
+/* ---Index----------------------------------------------------------------- */
+
+template <typename T> uint32_t Vertice<T>::Find(std::string_view name, size_t hash) const
 {
-	size_t pos = path.find_first_of(DELIMITER);
-	std::string head = std::string{ path.substr(0, pos) };	// Parse current node name
-	if (!_children.count(head))
-		_children[head] = std::pair<std::unique_ptr<T>, Vertice*>(nullptr, nullptr);
-	if (pos < path.length())	// == not a leaf
+	if (_index.empty())
 	{
-		if (_children[head].first) throw std::invalid_argument(" Cannot attach to a leaf: " + head);
-		if (!_children[head].second) _children[head].second = new Vertice();
-		_children[head].second->Add(path.substr(pos + 1, path.length() - (pos + 1)), data);
+		for (uint32_t i = 0; i != _children.size(); ++i)
+			if (_children[i].hash == hash && _children[i].name == name) return i;
+		return NONE;
 	}
-	else
+	const size_t mask = _index.size() - 1;
+	for (size_t slot = hash & mask; _index[slot]; slot = (slot + 1) & mask)
 	{
-		_children[head].first = std::make_unique<T>(data);
+		const Entry& e = _children[_index[slot] - 1];
+		if (e.hash == hash && e.name == name) return _index[slot] - 1;
 	}
+	return NONE;
 }
-
-template <typename T> void Vertice<T>::Destroy()
+template <typename T> uint32_t Vertice<T>::Insert(std::string_view name, size_t hash)
+{
+	_children.push_back({ std::string{ name }, hash, T{}, nullptr });
+	uint32_t entry = uint32_t(_children.size() - 1);
+	if (_children.size() * 2 > _index.size())
+	{
+		if (_children.size() >= INDEXED) Reindex(std::max(_index.size() * 2, INDEXED * 4));
+		return entry;
+	}
+	const size_t mask = _index.size() - 1;
+	size_t slot = hash & mask;
+	while (_index[slot]) slot = (slot + 1) & mask;
+	_index[slot] = entry + 1;
+	return entry;
+}
+template <typename T> size_t Vertice<T>::SlotOf(uint32_t entry) const
+{
+	const size_t mask = _index.size() - 1;
+	size_t slot = _children[entry].hash & mask;
+	while (_index[slot] != entry + 1) slot = (slot + 1) & mask;
+	return slot;
+}
+/// <summary>
+/// Removes the entry by moving the last one in its place. The probe chains are closed by backward shifting,
+/// so the index never has tombstones.
+/// </summary>
+template <typename T> void Vertice<T>::Erase(uint32_t entry)
 {
-	if (_children.size())
+	const uint32_t last = uint32_t(_children.size() - 1);
+	if (!_index.empty())
 	{
-		for (auto iter = _children.begin(); iter != _children.end(); ++iter)
-		{ 
-			if ((*iter).second.second)
+		const size_t mask = _index.size() - 1;
+		size_t hole = SlotOf(entry);
+		_index[hole] = 0;
+		for (size_t slot = (hole + 1) & mask; _index[slot]; slot = (slot + 1) & mask)
+		{
+			size_t home = _children[_index[slot] - 1].hash & mask;
+			if (((slot - home) & mask) >= ((slot - hole) & mask))	// The home is not between the hole and the slot
 			{
-				((*iter).second.second)->Destroy();
-				delete (*iter).second.second;
+				_index[hole] = _index[slot];
+				_index[slot] = 0;
+				hole = slot;
 			}
 		}
-		_children.clear();
+		if (entry != last) _index[SlotOf(last)] = entry + 1;
+	}
+	if (entry != last) _children[entry] = std::move(_children[last]);
+	_children.pop_back();
+}
+template <typename T> void Vertice<T>::Reindex(size_t capacity)
+{
+	_index.assign(capacity, 0);
+	const size_t mask = capacity - 1;
+	for (uint32_t i = 0; i != _children.size(); ++i)
+	{
+		size_t slot = _children[i].hash & mask;
+		while (_index[slot]) slot = (slot + 1) & mask;
+		_index[slot] = i + 1;
+	}
+}
+
+/* ---Vertice--------------------------------------------------------------- */
+
+template <typename T> void Vertice<T>::Add(std::string_view path, const T& data)
+{
+	Vertice* dir = this;
+	while (true)
+	{
+		size_t pos = path.find_first_of(DELIMITER);
+		std::string_view head = path.substr(0, pos);	// Parse current node name
+		size_t hash = Hash(head);
+		std::unique_lock<std::shared_mutex> lock(dir->_access);
+		uint32_t i = dir->Find(head, hash);
+		bool added = i == NONE;
+		if (added) i = dir->Insert(head, hash);
+		Entry& child = dir->_children[i];
+		if (pos == path.npos)
+		{
+			child.data = data;
+			return;
+		}
+		if (!child.dir)		// == not a leaf
+		{
+			if (!added) throw std::invalid_argument(" Cannot attach to a leaf: " + std::string{ head });
+			child.dir = new Vertice();
+		}
+		dir = child.dir;
+		path.remove_prefix(pos + 1);
+	}
+}
+
+/// <summary>
+/// Returns the child directory, creating it if there is none. [makeCode] is called only for a new directory and
+/// under the lock of this one, so concurrent callers create the directory once; if it throws, nothing is added.
+/// </summary>
+template <typename T> template <typename MakeCode> Vertice<T>* Vertice<T>::AddDir(std::string_view name, MakeCode&& makeCode)
+{
+	size_t hash = Hash(name);
+	std::unique_lock<std::shared_mutex> lock(_access);
+	uint32_t i = Find(name, hash);
+	if (i != NONE)
+	{
+		if (!_children[i].dir) throw std::invalid_argument(" Cannot attach to a leaf: " + std::string{ name });
+		return _children[i].dir;
+	}
+	Vertice* dir = new Vertice();
+	try
+	{
+		dir->_code = makeCode();
+		_children[Insert(name, hash)].dir = dir;
 	}
+	catch (...)
+	{
+		delete dir;
+		throw;
+	}
+	return dir;
+}
+/// <summary>
+/// Adds the leaf with the data returned by [make], which is called under the lock of this directory,
+/// so that nobody takes the name in between. If [make] throws, nothing is added.
+/// </summary>
+/// <returns>False if the name is taken already; [make] is not called then</returns>
+template <typename T> template <typename Make> bool Vertice<T>::AddLeaf(std::string_view name, Make&& make)
+{
+	size_t hash = Hash(name);
+	std::unique_lock<std::shared_mutex> lock(_access);
+	if (Find(name, hash) != NONE) return false;
+	T data = make();
+	_children[Insert(name, hash)].data = data;
+	return true;
+}
+
+template <typename T> void Vertice<T>::Remove(std::string_view name)
+{
+	std::unique_lock<std::shared_mutex> lock(_access);
+	uint32_t i = Find(name, Hash(name));
+	if (i == NONE) throw std::logic_error(std::string{ name } + " does not exist");
+	if (_children[i].dir) throw std::invalid_argument(" Cannot remove a directory: " + std::string{ name });
+	Erase(i);
+}
+
+template <typename T> void Vertice<T>::Destroy()
+{
+	std::unique_lock<std::shared_mutex> lock(_access);
+	for (auto& child : _children)
+		if (child.dir)
+		{
+			child.dir->Destroy();
+			delete child.dir;
+		}
+	_children.clear();
+	_index.clear();
 }
 
-template <typename T> T Vertice<T>::GetData(std::string_view path)
+template <typename T> T Vertice<T>::GetData(std::string_view path) const
 {
-	size_t pos = path.find_first_of(DELIMITER);
-	std::string head = std::string{ path.substr(0, pos) };
-	if (!_children.count(head)) throw std::logic_error(head + " does not exist");
-	
-	if (pos < path.length())	// == not a leaf
+	const Vertice* dir = this;
+	while (true)
 	{
-		if (!_children[head].second) throw std::logic_error(head + " is not a directory");
-		return _children[head].second->GetData(path.substr(pos + 1, path.length() - (pos + 1)));
+		size_t pos = path.find_first_of(DELIMITER);
+		std::string_view head = path.substr(0, pos);
+		size_t hash = Hash(head);
+		std::shared_lock<std::shared_mutex> lock(dir->_access);
+		uint32_t i = dir->Find(head, hash);
+		if (i == NONE) throw std::logic_error(std::string{ head } + " does not exist");
+
+		const Entry& child = dir->_children[i];
+		if (pos == path.npos)
+		{
+			if (child.dir) throw std::logic_error(std::string{ head } + " is a directory");
+			return child.data;
+		}
+		if (!child.dir) throw std::logic_error(std::string{ head } + " is not a directory");	// == a leaf
+		dir = child.dir;
+		path.remove_prefix(pos + 1);
 	}
-	else
-		return *_children[head].first;
 }
 
-template <typename T> uint32_t Vertice<T>::Count()
+template <typename T> T Vertice<T>::Seek(std::string_view path) const
 {
-	uint32_t count = _children.size();
-	for (auto iter = _children.begin(); iter != _children.end(); ++iter)
+	const Vertice* dir = this;
+	while (true)
 	{
-		count += (*iter).second.second->Count();
+		size_t pos = path.find_first_of(DELIMITER);
+		std::string_view head = path.substr(0, pos);
+		size_t hash = Hash(head);
+		std::shared_lock<std::shared_mutex> lock(dir->_access);
+		uint32_t i = dir->Find(head, hash);
+		if (i == NONE) return T{};
+		const Entry& child = dir->_children[i];
+		if (pos == path.npos) return child.dir ? T{} : child.data;
+		if (!child.dir) return T{};
+		dir = child.dir;
+		path.remove_prefix(pos + 1);
 	}
+}
+
+template <typename T> Vertice<T>* Vertice<T>::GetDir(std::string_view name) const
+{
+	size_t hash = Hash(name);
+	std::shared_lock<std::shared_mutex> lock(_access);
+	uint32_t i = Find(name, hash);
+	return i == NONE ? nullptr : _children[i].dir;
+}
+
+template <typename T> bool Vertice<T>::Contains(std::string_view name) const
+{
+	size_t hash = Hash(name);
+	std::shared_lock<std::shared_mutex> lock(_access);
+	return Find(name, hash) != NONE;
+}
+
+template <typename T> uint32_t Vertice<T>::Count() const
+{
+	std::shared_lock<std::shared_mutex> lock(_access);
+	uint32_t count = uint32_t(_children.size());
+	for (const auto& child : _children)
+		if (child.dir) count += child.dir->Count();
 	return count;
 }
 
-template <typename T> void Vertice<T>::BindNewTreeToChild(const std::string& name, Vertice<T>* nodePtr, bool deleteData)
+template <typename T> void Vertice<T>::BindNewTreeToChild(std::string_view name, Vertice<T>* nodePtr, bool deleteData)
 {
-	if (deleteData) _children[name].second->Destroy();
-	_children[name].first = nullptr;
-	_children[name].second = nodePtr;
+	size_t hash = Hash(name);
+	std::unique_lock<std::shared_mutex> lock(_access);
+	uint32_t i = Find(name, hash);
+	if (i == NONE) i = Insert(name, hash);
+	Entry& child = _children[i];
+	if (deleteData && child.dir) child.dir->Destroy();
+	child.data = T{};
+	child.dir = nodePtr;
 }
 
-template <typename T> std::string Vertice<T>::PrintVerticeTree(bool unpack, uint32_t count)
+/// <summary>
+/// Prints the tree with the children of each directory in the name order.
+/// </summary>
+template <typename T> std::string Vertice<T>::PrintVerticeTree(bool unpack, uint32_t count) const
 {
+	std::shared_lock<std::shared_mutex> lock(_access);
+	std::vector<const Entry*> sorted;
+	for (const auto& child : _children) sorted.push_back(&child);
+	std::sort(sorted.begin(), sorted.end(), [](const Entry* a, const Entry* b) { return a->name < b->name; });
+
 	std::ostringstream info;
-	if (!_children.empty())
+	for (const Entry* child : sorted)
 	{
-		for (auto iter = _children.begin(); iter != _children.end(); ++iter)
+		for (uint32_t i = 0; i != count; ++i) info << "  ";
+		info << child->name << " ";
+		if (!child->dir)
 		{
-			for (uint32_t i = 0; i != count; ++i) info << "  ";
-			info << (*iter).first << " ";
-			if ((*iter).second.first)
-			{
-				if (unpack) info << *(*((*iter).second.first));
-				else info << *((*iter).second.first);
-			}
-			else info << "X";
-			info << "\n";
-			if ((*iter).second.second) info << (*iter).second.second->PrintVerticeTree(unpack, count + 1);
+			if (unpack) info << *child->data;
+			else info << child->data;
 		}
+		else info << "X";
+		info << "\n";
+		if (child->dir) info << child->dir->PrintVerticeTree(unpack, count + 1);
 	}
 	return info.str();
 }
@@ -1,13 +1,16 @@
 ﻿#include <iostream>
 #include <string>
 #include <cstdlib>
+#include <filesystem>
 #include "IVFS.h"
 #include "Vertice.h"
+#include "Benchmarks.h"
 
 using namespace std;
 
 void run_test1(VFS* vfs, std::vector<std::string>& paths);
 void measure_time(void(*test)(VFS*, std::vector<std::string>&), VFS* v, std::vector<std::string>& paths);
+bool run_crash_check();
 
 int main()
 {
@@ -20,6 +23,18 @@ int main()
 		"alpha"
 	};
 
+	const bool benchmarks = false;		// <-- Set true to run the benchmarks (see Benchmarks.h) instead of the test
+	if (benchmarks)
+	{
+		run_benchmarks();
+		return 0;
+	}
+	const bool crash_check = false;		// <-- Set true to run the journal crash check instead of the test
+	if (crash_check)
+	{
+		return run_crash_check() ? 0 : 1;
+	}
+
 	std::cout << "Testing disk: " << diskname << endl;
 	VFS* vfs = new VFS();
 	if (vfs->MountOrCreate(diskname))
@@ -321,6 +336,60 @@ floor.",
 	}
 }
 
+/// <summary>
+/// Journal replay after deletes: the title blocks freed by the deletes are reused as data blocks of a new file,
+/// which must read back the same once the VDisk is replayed. The crash is a copy of the VDisk file taken while
+/// it's mounted, so the metadata is in the journal and not yet at its home location.
+/// </summary>
+bool run_crash_check()
+{
+	const std::string diskname = "crash.tfs", crashed = "crash_copy.tfs";
+	const int files = 20;					// <-- Set how many files to delete before the crash
+	std::string data(400 * 1024, 0);
+	for (size_t i = 0; i != data.size(); ++i) data[i] = char('a' + i * 7 % 26);
+
+	std::filesystem::remove(diskname);
+	{
+		VFS vfs;
+		if (!vfs.CreateAndMount(diskname, 64 * 1024 * 1024)) return false;
+		std::string small(20000, 'x');
+		for (int i = 0; i != files; ++i)
+		{
+			File* f = vfs.Create(("deleted\\f" + std::to_string(i)).c_str());
+			vfs.Write(f, small.data(), small.size());
+			vfs.Close(f);
+		}
+		for (int i = 0; i != files; ++i) vfs.Delete(("deleted\\f" + std::to_string(i)).c_str());
+		File* f = vfs.Create("survivor");
+		vfs.Write(f, data.data(), data.size());
+		vfs.Close(f);
+		std::filesystem::copy_file(diskname, crashed, std::filesystem::copy_options::overwrite_existing);
+	}
+
+	size_t wrong = data.size();
+	{
+		VFS vfs;
+		std::string name = crashed;
+		if (vfs.MountOrCreate(name))
+		{
+			if (File* f = vfs.Open("survivor"))
+			{
+				std::string read(data.size(), 0);
+				read.resize(vfs.Read(f, read.data(), read.size()));
+				vfs.Close(f);
+				wrong = read.size() == data.size() ? 0 : data.size();
+				for (size_t i = 0; i != read.size(); ++i) wrong += read[i] != data[i];
+			}
+			vfs.Unmount(name);
+		}
+	}
+	std::filesystem::remove(diskname);
+	std::filesystem::remove(crashed);
+
+	cout << "\n>> Crash check: " << (wrong ? std::to_string(wrong) + " bytes differ after the replay" : "passed") << endl;
+	return !wrong;
+}
+
 void measure_time(void(*test)(VFS*, std::vector<std::string>& paths), VFS* v, std::vector<std::string>& paths)
 {
 	clock_t tStart, tFin;